@@ -0,0 +1,114 @@
+#ifndef DEVICE_STATE_H
+#define DEVICE_STATE_H
+
+#pragma once
+
+#include "pose_history.h"
+#include "pose_snapshot.h"
+
+#include <openhmd.h>
+
+// Tracking state of every opened OpenHMD device, stored as structure of arrays indexed by slot.
+// After ohmd_ctx_update the pose producer fills all slots in one Ingest pass, may filter them
+// in place, and then Publish pushes every slot into its history and snapshot. The per-device
+// driver objects only keep their slot and read their snapshot.
+class DeviceStateStore
+{
+public:
+    static const int kMaxDevices = 16;
+
+    DeviceStateStore() : m_count(0), m_velocityWindowNs(0) {}
+
+    // Returns the slot of the device or -1 if the store is full. Rotation and position are only
+    // read from OpenHMD when requested, otherwise the initial values are kept.
+    // All devices are added before the pose producer starts.
+    int AddDevice(ohmd_device *dev, bool read_rotation, bool read_position, const float *initial_pos)
+    {
+        if (m_count == kMaxDevices)
+            return -1;
+
+        int slot = m_count;
+        device[slot] = dev;
+        flags[slot] = (read_rotation ? kReadRotation : 0) | (read_position ? kReadPosition : 0);
+        qx[slot] = qy[slot] = qz[slot] = 0;
+        qw[slot] = 1;
+        px[slot] = initial_pos[0];
+        py[slot] = initial_pos[1];
+        pz[slot] = initial_pos[2];
+        time[slot] = PoseClockNow();
+        snapshot[slot].Store(Gather(slot));
+
+        m_count++;
+        return slot;
+    }
+
+    int Count() const { return m_count; }
+
+    void SetVelocityWindow(int64_t window_ns) { m_velocityWindowNs = window_ns; }
+
+    // reads the current pose of all devices, call right after ohmd_ctx_update
+    void Ingest()
+    {
+        int64_t now = PoseClockNow();
+        float v[4];
+        for (int slot = 0; slot < m_count; slot++) {
+            if (flags[slot] & kReadRotation) {
+                ohmd_device_getf(device[slot], OHMD_ROTATION_QUAT, v);
+                qx[slot] = v[0];
+                qy[slot] = v[1];
+                qz[slot] = v[2];
+                qw[slot] = v[3];
+            }
+            if (flags[slot] & kReadPosition) {
+                ohmd_device_getf(device[slot], OHMD_POSITION_VECTOR, v);
+                px[slot] = v[0];
+                py[slot] = v[1];
+                pz[slot] = v[2];
+            }
+            time[slot] = now;
+        }
+    }
+
+    // appends the ingested (and filtered) poses to the histories and publishes the snapshots
+    void Publish()
+    {
+        for (int slot = 0; slot < m_count; slot++) {
+            history[slot].Push(Gather(slot));
+            history[slot].EstimateVelocity(m_velocityWindowNs);
+            snapshot[slot].Store(history[slot].Get(0));
+        }
+    }
+
+    PoseSample Gather(int slot) const
+    {
+        PoseSample s = PoseSample();
+        s.quat[0] = qx[slot];
+        s.quat[1] = qy[slot];
+        s.quat[2] = qz[slot];
+        s.quat[3] = qw[slot];
+        s.pos[0] = px[slot];
+        s.pos[1] = py[slot];
+        s.pos[2] = pz[slot];
+        s.time = time[slot];
+        return s;
+    }
+
+    float qx[kMaxDevices], qy[kMaxDevices], qz[kMaxDevices], qw[kMaxDevices];
+    float px[kMaxDevices], py[kMaxDevices], pz[kMaxDevices];
+    int64_t time[kMaxDevices];
+    int flags[kMaxDevices];
+    ohmd_device *device[kMaxDevices];
+
+    // written by the pose producer only
+    PoseHistory history[kMaxDevices];
+    // written by the pose producer, read by anyone
+    PoseSnapshot snapshot[kMaxDevices];
+
+private:
+    enum { kReadRotation = 1, kReadPosition = 2 };
+
+    int m_count;
+    int64_t m_velocityWindowNs;
+};
+
+#endif // DEVICE_STATE_H
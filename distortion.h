@@ -0,0 +1,310 @@
+#ifndef DISTORTION_H
+#define DISTORTION_H
+
+#pragma once
+
+#include <openvr_driver.h>
+#include <openhmd.h>
+#include "driverlog.h"
+#include "distortion_batch.h"
+#include "distortion_cache.h"
+#include "distortion_quadtree.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include <string.h>
+
+// Optical parameters of an HMD as used by ComputeDistortion, queried from OpenHMD once instead
+// of on every UV sample, together with the values derived from them.
+// A model is not modified after it has been published to ComputeDistortion. When the parameters
+// change a new model is built and swapped in, so a distortion mesh is always computed from one
+// consistent model.
+class DistortionModel
+{
+public:
+    explicit DistortionModel(ohmd_device *hmd)
+    {
+        memset(&m_params, 0, sizeof(m_params));
+        ohmd_device_geti(hmd, OHMD_SCREEN_HORIZONTAL_RESOLUTION, &m_params.hmd_w);
+        ohmd_device_geti(hmd, OHMD_SCREEN_VERTICAL_RESOLUTION, &m_params.hmd_h);
+        ohmd_device_getf(hmd, OHMD_EYE_IPD, &m_params.ipd);
+        ohmd_device_getf(hmd, OHMD_SCREEN_HORIZONTAL_SIZE, &m_params.screen_size[0]);
+        ohmd_device_getf(hmd, OHMD_SCREEN_VERTICAL_SIZE, &m_params.screen_size[1]);
+        ohmd_device_getf(hmd, OHMD_UNIVERSAL_DISTORTION_K, m_params.distortion_k);
+        ohmd_device_getf(hmd, OHMD_UNIVERSAL_ABERRATION_K, m_params.aberration_k);
+        ohmd_device_getf(hmd, OHMD_LENS_HORIZONTAL_SEPARATION, &m_params.lens_sep);
+        ohmd_device_getf(hmd, OHMD_LENS_VERTICAL_POSITION, &m_params.lens_vpos);
+
+        for (int eye = 0; eye < 2; eye++) {
+            DistortionBatchParams &p = m_eye[eye];
+
+            //viewport is half the screen
+            p.viewport_scale[0] = m_params.screen_size[0] / 2.0f;
+            p.viewport_scale[1] = m_params.screen_size[1];
+
+            //calculate lens centers (assuming the eye separation is the distance between the lens centers)
+            p.lens_center[0] = eye == vr::Eye_Left ? p.viewport_scale[0] - m_params.lens_sep / 2.0f : m_params.lens_sep / 2.0f;
+            p.lens_center[1] = m_params.lens_vpos;
+
+            memcpy(p.k, m_params.distortion_k, sizeof(p.k));
+            memcpy(p.aberration, m_params.aberration_k, sizeof(p.aberration));
+        }
+
+        //asume calibration was for lens view to which ever edge of screen is further away from lens center
+        float warp_scale = m_eye[vr::Eye_Left].lens_center[0] > m_eye[vr::Eye_Right].lens_center[0] ? m_eye[vr::Eye_Left].lens_center[0] : m_eye[vr::Eye_Right].lens_center[0];
+        m_eye[vr::Eye_Left].warp_scale = warp_scale;
+        m_eye[vr::Eye_Right].warp_scale = warp_scale;
+    }
+
+    // true if hmd still reports the parameters this model was built from
+    bool IsCurrent(ohmd_device *hmd) const
+    {
+        DistortionModel current(hmd);
+        return memcmp(&current.m_params, &m_params, sizeof(m_params)) == 0;
+    }
+
+    float GetIPD() const { return m_params.ipd; }
+    const float *GetDistortionK() const { return m_params.distortion_k; }
+    const DistortionBatchParams &GetEyeParams(vr::EVREye eEye) const { return m_eye[eEye == vr::Eye_Left ? vr::Eye_Left : vr::Eye_Right]; }
+
+    // Evaluates the model at the nodes of a resolution x resolution grid per eye. Distort then
+    // interpolates bilinearly between the nodes, and logs how far that is off from the exact
+    // model and how long both take. The rows of both eyes are spread over the given number of
+    // threads. Call before the model is published.
+    void BuildGrid(int resolution, int threads)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        m_gridSize = resolution;
+        m_grid.resize(2 * (resolution + 1) * (resolution + 1));
+
+        const int rows = 2 * (resolution + 1);
+        if (threads > rows)
+            threads = rows;
+        if (threads < 1)
+            threads = 1;
+
+        std::atomic<int> nextRow(0);
+        std::vector<std::thread> pool;
+        for (int t = 1; t < threads; t++)
+            pool.push_back(std::thread(&DistortionModel::BuildGridRows, this, &nextRow));
+        BuildGridRows(&nextRow);
+        for (size_t t = 0; t < pool.size(); t++)
+            pool[t].join();
+
+        DriverLog("driver_openhmd: distortion grid %dx%d built in %.2f ms with %d threads\n", resolution, resolution,
+                  std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), threads);
+        ReportGridAccuracy();
+    }
+
+    // Instead of BuildGrid, an adaptive mesh that is refined down to cells of 1/max_resolution
+    // of the viewport where the uniform grid would be off by more than tolerance pixels.
+    void BuildQuadtree(int max_resolution, float tolerance)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        m_quadtree.Build(m_eye, max_resolution, tolerance, m_params.hmd_w / 2.0f, (float) m_params.hmd_h);
+
+        int uniform = m_quadtree.Resolution();
+        DriverLog("driver_openhmd: adaptive distortion mesh (tolerance %.3f px, finest %dx%d) built in %.2f ms: %d cells, %d vertices, %.1f KiB (uniform %dx%d grid: %.1f KiB)\n",
+                  tolerance, uniform, uniform,
+                  std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(),
+                  m_quadtree.LeafCount(), m_quadtree.VertexCount(), m_quadtree.MemoryBytes() / 1024.0,
+                  uniform, uniform, 2.0 * (uniform + 1) * (uniform + 1) * sizeof(vr::DistortionCoordinates_t) / 1024.0);
+        ReportGridAccuracy();
+    }
+
+    // Distort for n UVs at once
+    void DistortMany(vr::EVREye eEye, const float *u, const float *v, int n, vr::DistortionCoordinates_t *out) const
+    {
+        if (m_grid.empty() && m_quadtree.Empty()) {
+            DistortExactBatch(eEye, u, v, n, out);
+            return;
+        }
+        for (int i = 0; i < n; i++)
+            out[i] = Distort(eEye, u[i], v[i]);
+    }
+
+    // identifies the optical parameters of the headset device_id in the distortion cache
+    uint64_t CacheKey(const std::string &device_id) const
+    {
+        return DistortionCacheHash(&m_params, sizeof(m_params), DistortionCacheHash(device_id.data(), device_id.size()));
+    }
+
+    // instead of BuildGrid, returns false if the cache has no matching grid
+    bool LoadGrid(const std::string &path, uint64_t key, int resolution)
+    {
+        if (!ReadDistortionCache(path, key, resolution, m_grid))
+            return false;
+        m_gridSize = resolution;
+        return true;
+    }
+
+    bool SaveGrid(const std::string &path, uint64_t key) const
+    {
+        return WriteDistortionCache(path, key, m_gridSize, m_grid);
+    }
+
+    // fU, fV are in the unrotated eye viewport
+    vr::DistortionCoordinates_t Distort(vr::EVREye eEye, float fU, float fV) const
+    {
+        if ((m_grid.empty() && m_quadtree.Empty()) || fU < 0 || fU > 1 || fV < 0 || fV > 1)
+            return DistortExact(eEye, fU, fV);
+
+        int eye = eEye == vr::Eye_Left ? 0 : 1;
+        if (!m_quadtree.Empty())
+            return m_quadtree.Sample(eye, fU, fV);
+
+        float x = fU * m_gridSize, y = fV * m_gridSize;
+        int i = (int) x, j = (int) y;
+        if (i == m_gridSize)
+            i--;
+        if (j == m_gridSize)
+            j--;
+        float fx = x - i, fy = y - j;
+
+        const float *c00 = &m_grid[(eye * (m_gridSize + 1) + j) * (m_gridSize + 1) + i].rfRed[0];
+        const float *c10 = c00 + kCoordinateFloats;
+        const float *c01 = c00 + (m_gridSize + 1) * kCoordinateFloats;
+        const float *c11 = c01 + kCoordinateFloats;
+
+        float out[kCoordinateFloats];
+        for (int k = 0; k < kCoordinateFloats; k++) {
+            float top = c00[k] + (c10[k] - c00[k]) * fx;
+            float bottom = c01[k] + (c11[k] - c01[k]) * fx;
+            out[k] = top + (bottom - top) * fy;
+        }
+
+        vr::DistortionCoordinates_t coordinates;
+        memcpy(&coordinates, out, sizeof(coordinates));
+        return coordinates;
+    }
+
+    vr::DistortionCoordinates_t DistortExact(vr::EVREye eEye, float fU, float fV) const
+    {
+        vr::DistortionCoordinates_t coordinates;
+        DistortExactBatch(eEye, &fU, &fV, 1, &coordinates);
+        return coordinates;
+    }
+
+    void DistortExactBatch(vr::EVREye eEye, const float *u, const float *v, int n, vr::DistortionCoordinates_t *out) const
+    {
+        DistortBatch(GetEyeParams(eEye), u, v, n, out);
+    }
+
+    // Derivative of the green distorted UV by the panel UV at the lens center of eEye, with
+    // jacobian[i][j] = d out[i] / d in[j]. Its diagonal is how many render target pixels one
+    // panel pixel spans there, for a render target as large as the panel.
+    void CenterJacobian(vr::EVREye eEye, float jacobian[2][2]) const
+    {
+        const DistortionBatchParams &p = GetEyeParams(eEye);
+        const float u = p.lens_center[0] / p.viewport_scale[0], v = p.lens_center[1] / p.viewport_scale[1];
+        const float h = 1e-3f;
+        float us[4] = { u + h, u - h, u, u }, vs[4] = { v, v, v + h, v - h };
+        vr::DistortionCoordinates_t out[4];
+        DistortExactBatch(eEye, us, vs, 4, out);
+        for (int i = 0; i < 2; i++) {
+            jacobian[i][0] = (out[0].rfGreen[i] - out[1].rfGreen[i]) / (2 * h);
+            jacobian[i][1] = (out[2].rfGreen[i] - out[3].rfGreen[i]) / (2 * h);
+        }
+    }
+
+    // the UVs that channel (0 red, 1 green, 2 blue) of DistortExact maps to u, v
+    void Undistort(vr::EVREye eEye, int channel, const float *u, const float *v, int n, float *out_u, float *out_v) const
+    {
+        UndistortBatch(GetEyeParams(eEye), channel, u, v, n, out_u, out_v);
+    }
+
+    void BenchmarkUndistort() const
+    {
+        BenchmarkUndistortBatch(m_eye[vr::Eye_Left], m_params.hmd_w / 2.0f, (float) m_params.hmd_h);
+    }
+
+private:
+    // everything queried from OpenHMD, compared as a whole to detect changes
+    struct Params
+    {
+        int hmd_w;
+        int hmd_h;
+        float ipd;
+        float screen_size[2];
+        float distortion_k[4];
+        float aberration_k[3];
+        float lens_sep;
+        float lens_vpos;
+    };
+
+    // evaluates grid rows until all are taken, a row is one v of one eye
+    void BuildGridRows(std::atomic<int> *nextRow)
+    {
+        const int rows = 2 * (m_gridSize + 1);
+        std::vector<float> u(m_gridSize + 1), v(m_gridSize + 1);
+        for (int i = 0; i <= m_gridSize; i++)
+            u[i] = (float) i / m_gridSize;
+
+        for (int row = (*nextRow)++; row < rows; row = (*nextRow)++) {
+            int eye = row / (m_gridSize + 1), j = row % (m_gridSize + 1);
+            for (int i = 0; i <= m_gridSize; i++)
+                v[i] = (float) j / m_gridSize;
+            DistortExactBatch((vr::EVREye) eye, u.data(), v.data(), m_gridSize + 1, &m_grid[row * (m_gridSize + 1)]);
+        }
+    }
+
+    static const int kCoordinateFloats = sizeof(vr::DistortionCoordinates_t) / sizeof(float);
+    static_assert(sizeof(vr::DistortionCoordinates_t) == 6 * sizeof(float), "DistortionCoordinates_t is expected to be 6 floats");
+
+    // compares grid or adaptive mesh with the exact model between the grid nodes and logs the
+    // error in pixels
+    void ReportGridAccuracy() const
+    {
+        const int resolution = m_quadtree.Empty() ? m_gridSize : m_quadtree.Resolution();
+        const int samples = resolution * 4 + 1;
+        const int count = 2 * samples * samples;
+        const float pixels_u = m_params.hmd_w / 2.0f, pixels_v = (float) m_params.hmd_h;
+
+        // offset so most samples fall between grid nodes
+        std::vector<float> u(count), v(count);
+        for (int n = 0; n < count; n++) {
+            u[n] = (n % samples + 0.37f) / samples;
+            v[n] = (n / samples % samples + 0.61f) / samples;
+        }
+        const int perEye = samples * samples;
+
+        std::vector<vr::DistortionCoordinates_t> exact(count), grid(count);
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        for (int eye = 0; eye < 2; eye++)
+            DistortExactBatch((vr::EVREye) eye, &u[eye * perEye], &v[eye * perEye], perEye, &exact[eye * perEye]);
+        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+        for (int eye = 0; eye < 2; eye++)
+            DistortMany((vr::EVREye) eye, &u[eye * perEye], &v[eye * perEye], perEye, &grid[eye * perEye]);
+        std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+
+        double maxError = 0, sumError = 0;
+        for (int n = 0; n < count; n++) {
+            const float *a = &exact[n].rfRed[0], *b = &grid[n].rfRed[0];
+            for (int c = 0; c < kCoordinateFloats; c += 2) {
+                double du = (a[c] - b[c]) * pixels_u, dv = (a[c + 1] - b[c + 1]) * pixels_v;
+                double e = sqrt(du * du + dv * dv);
+                if (e > maxError)
+                    maxError = e;
+                sumError += e;
+            }
+        }
+
+        DriverLog("driver_openhmd: distortion %s %dx%d: max error %.4f px, mean error %.4f px, exact %.1f ns, interpolated %.1f ns per sample\n",
+                  m_quadtree.Empty() ? "grid" : "mesh", resolution, resolution, maxError, sumError / (count * 3),
+                  std::chrono::duration<double, std::nano>(t1 - t0).count() / count,
+                  std::chrono::duration<double, std::nano>(t2 - t1).count() / count);
+    }
+
+    Params m_params;
+    DistortionBatchParams m_eye[2];
+
+    // optional, see BuildGrid and BuildQuadtree
+    int m_gridSize = 0;
+    std::vector<vr::DistortionCoordinates_t> m_grid;
+    DistortionQuadtree m_quadtree;
+};
+
+#endif // DISTORTION_H
@@ -0,0 +1,509 @@
+#include "distortion_batch.h"
+#include "driverlog.h"
+
+#include <chrono>
+#include <vector>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define DISTORTION_BATCH_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define DISTORTION_TARGET(isa)
+#else
+#define DISTORTION_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+typedef void (*DistortKernel)(const DistortionBatchParams &p, const float *u, const float *v, int n, vr::DistortionCoordinates_t *out);
+typedef void (*UndistortKernel)(const DistortionBatchParams &p, int channel, int iterations, const float *u, const float *v, int n, float *out_u, float *out_v);
+
+static const int kMaxUndistortIterations = 16;
+
+// Lower bound of the Newton derivative, relative to its value k3 at the lens center. Where
+// s f(s) turns flat or back because the model folds over, the step stays finite and the
+// iteration keeps moving outwards instead of dividing by zero.
+static const float kMinUndistortSlope = 1e-3f;
+
+// The SIMD kernels evaluate the same operations in the same order as this one.
+static void DistortScalar(const DistortionBatchParams &p, const float *u, const float *v, int n, vr::DistortionCoordinates_t *out)
+{
+    for (int i = 0; i < n; i++) {
+        float r0 = (u[i] * p.viewport_scale[0] - p.lens_center[0]) / p.warp_scale;
+        float r1 = (v[i] * p.viewport_scale[1] - p.lens_center[1]) / p.warp_scale;
+        float r_mag = sqrtf(r0 * r0 + r1 * r1);
+        float r_scale = p.k[3] + p.k[2] * r_mag + p.k[1] * r_mag * r_mag + p.k[0] * r_mag * r_mag * r_mag;
+        float d0 = r0 * r_scale * p.warp_scale;
+        float d1 = r1 * r_scale * p.warp_scale;
+
+        out[i].rfRed[0] = (p.lens_center[0] + p.aberration[0] * d0) / p.viewport_scale[0];
+        out[i].rfRed[1] = (p.lens_center[1] + p.aberration[0] * d1) / p.viewport_scale[1];
+        out[i].rfGreen[0] = (p.lens_center[0] + p.aberration[1] * d0) / p.viewport_scale[0];
+        out[i].rfGreen[1] = (p.lens_center[1] + p.aberration[1] * d1) / p.viewport_scale[1];
+        out[i].rfBlue[0] = (p.lens_center[0] + p.aberration[2] * d0) / p.viewport_scale[0];
+        out[i].rfBlue[1] = (p.lens_center[1] + p.aberration[2] * d1) / p.viewport_scale[1];
+    }
+}
+
+// The distorted point q, relative to the lens center and in units of warp_scale, is
+// r * f(|r|) with f(s) = k3 + k2 s + k1 s^2 + k0 s^3. The radius s = |r| is the root of
+// s f(s) - |q|, and then r = q / f(s). The SIMD kernels do the same.
+// Newton is started at |q| / k3 and runs a fixed number of iterations, so all lanes run the
+// same instructions. Needs UndistortDefined.
+static void UndistortScalar(const DistortionBatchParams &p, int channel, int iterations, const float *u, const float *v, int n, float *out_u, float *out_v)
+{
+    const float scale = p.aberration[channel] * p.warp_scale;
+    const float min_dg = kMinUndistortSlope * p.k[3];
+    for (int i = 0; i < n; i++) {
+        float q0 = (u[i] * p.viewport_scale[0] - p.lens_center[0]) / scale;
+        float q1 = (v[i] * p.viewport_scale[1] - p.lens_center[1]) / scale;
+        float q_mag = sqrtf(q0 * q0 + q1 * q1);
+
+        float s = q_mag / p.k[3];
+        for (int it = 0; it < iterations; it++) {
+            float g = s * (p.k[3] + s * (p.k[2] + s * (p.k[1] + s * p.k[0]))) - q_mag;
+            float dg = fmaxf(p.k[3] + s * (2 * p.k[2] + s * (3 * p.k[1] + s * 4 * p.k[0])), min_dg);
+            s = fmaxf(s - g / dg, 0.0f);
+        }
+        float f = p.k[3] + s * (p.k[2] + s * (p.k[1] + s * p.k[0]));
+
+        out_u[i] = (q0 / f * p.warp_scale + p.lens_center[0]) / p.viewport_scale[0];
+        out_v[i] = (q1 / f * p.warp_scale + p.lens_center[1]) / p.viewport_scale[1];
+    }
+}
+
+// The inverse needs a model that doesn't collapse the lens center (k3 > 0) and scales that are
+// not zero. Not the case for all-zero parameters, which some devices report.
+static bool UndistortDefined(const DistortionBatchParams &p, int channel)
+{
+    return p.k[3] > 0 && p.aberration[channel] > 0 && p.warp_scale > 0;
+}
+
+// Newton iterations the farthest point of interest needs to converge to float precision: the
+// corners of the viewport, and where DistortBatch maps them. Points closer to the lens center
+// need fewer, the distortion grows with the radius.
+static int UndistortIterations(const DistortionBatchParams &p, int channel)
+{
+    const float scale = p.aberration[channel] * p.warp_scale;
+    float q_mag = 0;
+    for (int corner = 0; corner < 4; corner++) {
+        float r0 = ((corner & 1) * p.viewport_scale[0] - p.lens_center[0]) / p.warp_scale;
+        float r1 = ((corner >> 1) * p.viewport_scale[1] - p.lens_center[1]) / p.warp_scale;
+        float r_mag = sqrtf(r0 * r0 + r1 * r1);
+        float r_scale = p.k[3] + r_mag * (p.k[2] + r_mag * (p.k[1] + r_mag * p.k[0]));
+        q_mag = fmaxf(q_mag, r_mag * p.warp_scale / scale);
+        q_mag = fmaxf(q_mag, r_mag * r_scale / p.aberration[channel]);
+    }
+
+    float s = q_mag / p.k[3];
+    int iterations = 1;
+    for (; iterations < kMaxUndistortIterations; iterations++) {
+        float g = s * (p.k[3] + s * (p.k[2] + s * (p.k[1] + s * p.k[0]))) - q_mag;
+        float dg = fmaxf(p.k[3] + s * (2 * p.k[2] + s * (3 * p.k[1] + s * 4 * p.k[0])), kMinUndistortSlope * p.k[3]);
+        float step = g / dg;
+        s = fmaxf(s - step, 0.0f);
+        if (fabsf(step) <= 1e-6f * s)
+            break;
+    }
+    return iterations;
+}
+
+// the kernels compute 6 output lanes (red u, red v, green u, ...) and interleave them here
+static inline void StoreCoordinates(const float *lanes, int width, vr::DistortionCoordinates_t *out)
+{
+    for (int i = 0; i < width; i++) {
+        out[i].rfRed[0] = lanes[0 * width + i];
+        out[i].rfRed[1] = lanes[1 * width + i];
+        out[i].rfGreen[0] = lanes[2 * width + i];
+        out[i].rfGreen[1] = lanes[3 * width + i];
+        out[i].rfBlue[0] = lanes[4 * width + i];
+        out[i].rfBlue[1] = lanes[5 * width + i];
+    }
+}
+
+#ifdef DISTORTION_BATCH_X86
+
+DISTORTION_TARGET("sse2")
+static void DistortSSE2(const DistortionBatchParams &p, const float *u, const float *v, int n, vr::DistortionCoordinates_t *out)
+{
+    const __m128 vs0 = _mm_set1_ps(p.viewport_scale[0]), vs1 = _mm_set1_ps(p.viewport_scale[1]);
+    const __m128 lc0 = _mm_set1_ps(p.lens_center[0]), lc1 = _mm_set1_ps(p.lens_center[1]);
+    const __m128 warp = _mm_set1_ps(p.warp_scale);
+    const __m128 k0 = _mm_set1_ps(p.k[0]), k1 = _mm_set1_ps(p.k[1]), k2 = _mm_set1_ps(p.k[2]), k3 = _mm_set1_ps(p.k[3]);
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 r0 = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(u + i), vs0), lc0), warp);
+        __m128 r1 = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(v + i), vs1), lc1), warp);
+        __m128 r_mag = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(r0, r0), _mm_mul_ps(r1, r1)));
+        __m128 r_scale = _mm_add_ps(_mm_add_ps(_mm_add_ps(k3, _mm_mul_ps(k2, r_mag)),
+                                               _mm_mul_ps(_mm_mul_ps(k1, r_mag), r_mag)),
+                                    _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(k0, r_mag), r_mag), r_mag));
+        __m128 d0 = _mm_mul_ps(_mm_mul_ps(r0, r_scale), warp);
+        __m128 d1 = _mm_mul_ps(_mm_mul_ps(r1, r_scale), warp);
+
+        float lanes[6 * 4];
+        for (int c = 0; c < 3; c++) {
+            __m128 ab = _mm_set1_ps(p.aberration[c]);
+            _mm_storeu_ps(lanes + (2 * c) * 4, _mm_div_ps(_mm_add_ps(lc0, _mm_mul_ps(ab, d0)), vs0));
+            _mm_storeu_ps(lanes + (2 * c + 1) * 4, _mm_div_ps(_mm_add_ps(lc1, _mm_mul_ps(ab, d1)), vs1));
+        }
+        StoreCoordinates(lanes, 4, out + i);
+    }
+    DistortScalar(p, u + i, v + i, n - i, out + i);
+}
+
+DISTORTION_TARGET("sse2")
+static void UndistortSSE2(const DistortionBatchParams &p, int channel, int iterations, const float *u, const float *v, int n, float *out_u, float *out_v)
+{
+    const __m128 vs0 = _mm_set1_ps(p.viewport_scale[0]), vs1 = _mm_set1_ps(p.viewport_scale[1]);
+    const __m128 lc0 = _mm_set1_ps(p.lens_center[0]), lc1 = _mm_set1_ps(p.lens_center[1]);
+    const __m128 warp = _mm_set1_ps(p.warp_scale), scale = _mm_set1_ps(p.aberration[channel] * p.warp_scale);
+    const __m128 k0 = _mm_set1_ps(p.k[0]), k1 = _mm_set1_ps(p.k[1]), k2 = _mm_set1_ps(p.k[2]), k3 = _mm_set1_ps(p.k[3]);
+    const __m128 k0x4 = _mm_set1_ps(4 * p.k[0]), k1x3 = _mm_set1_ps(3 * p.k[1]), k2x2 = _mm_set1_ps(2 * p.k[2]);
+    const __m128 zero = _mm_setzero_ps(), min_dg = _mm_set1_ps(kMinUndistortSlope * p.k[3]);
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 q0 = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(u + i), vs0), lc0), scale);
+        __m128 q1 = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(v + i), vs1), lc1), scale);
+        __m128 q_mag = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(q0, q0), _mm_mul_ps(q1, q1)));
+
+        __m128 s = _mm_div_ps(q_mag, k3);
+        for (int it = 0; it < iterations; it++) {
+            __m128 g = _mm_sub_ps(_mm_mul_ps(s, _mm_add_ps(k3, _mm_mul_ps(s, _mm_add_ps(k2, _mm_mul_ps(s, _mm_add_ps(k1, _mm_mul_ps(s, k0))))))), q_mag);
+            __m128 dg = _mm_max_ps(_mm_add_ps(k3, _mm_mul_ps(s, _mm_add_ps(k2x2, _mm_mul_ps(s, _mm_add_ps(k1x3, _mm_mul_ps(s, k0x4)))))), min_dg);
+            s = _mm_max_ps(_mm_sub_ps(s, _mm_div_ps(g, dg)), zero);
+        }
+        __m128 f = _mm_add_ps(k3, _mm_mul_ps(s, _mm_add_ps(k2, _mm_mul_ps(s, _mm_add_ps(k1, _mm_mul_ps(s, k0))))));
+
+        _mm_storeu_ps(out_u + i, _mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_div_ps(q0, f), warp), lc0), vs0));
+        _mm_storeu_ps(out_v + i, _mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_div_ps(q1, f), warp), lc1), vs1));
+    }
+    UndistortScalar(p, channel, iterations, u + i, v + i, n - i, out_u + i, out_v + i);
+}
+
+DISTORTION_TARGET("avx2")
+static void DistortAVX2(const DistortionBatchParams &p, const float *u, const float *v, int n, vr::DistortionCoordinates_t *out)
+{
+    const __m256 vs0 = _mm256_set1_ps(p.viewport_scale[0]), vs1 = _mm256_set1_ps(p.viewport_scale[1]);
+    const __m256 lc0 = _mm256_set1_ps(p.lens_center[0]), lc1 = _mm256_set1_ps(p.lens_center[1]);
+    const __m256 warp = _mm256_set1_ps(p.warp_scale);
+    const __m256 k0 = _mm256_set1_ps(p.k[0]), k1 = _mm256_set1_ps(p.k[1]), k2 = _mm256_set1_ps(p.k[2]), k3 = _mm256_set1_ps(p.k[3]);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 r0 = _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(u + i), vs0), lc0), warp);
+        __m256 r1 = _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(v + i), vs1), lc1), warp);
+        __m256 r_mag = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(r0, r0), _mm256_mul_ps(r1, r1)));
+        __m256 r_scale = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(k3, _mm256_mul_ps(k2, r_mag)),
+                                                     _mm256_mul_ps(_mm256_mul_ps(k1, r_mag), r_mag)),
+                                       _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(k0, r_mag), r_mag), r_mag));
+        __m256 d0 = _mm256_mul_ps(_mm256_mul_ps(r0, r_scale), warp);
+        __m256 d1 = _mm256_mul_ps(_mm256_mul_ps(r1, r_scale), warp);
+
+        float lanes[6 * 8];
+        for (int c = 0; c < 3; c++) {
+            __m256 ab = _mm256_set1_ps(p.aberration[c]);
+            _mm256_storeu_ps(lanes + (2 * c) * 8, _mm256_div_ps(_mm256_add_ps(lc0, _mm256_mul_ps(ab, d0)), vs0));
+            _mm256_storeu_ps(lanes + (2 * c + 1) * 8, _mm256_div_ps(_mm256_add_ps(lc1, _mm256_mul_ps(ab, d1)), vs1));
+        }
+        StoreCoordinates(lanes, 8, out + i);
+    }
+    DistortScalar(p, u + i, v + i, n - i, out + i);
+}
+
+DISTORTION_TARGET("avx2")
+static void UndistortAVX2(const DistortionBatchParams &p, int channel, int iterations, const float *u, const float *v, int n, float *out_u, float *out_v)
+{
+    const __m256 vs0 = _mm256_set1_ps(p.viewport_scale[0]), vs1 = _mm256_set1_ps(p.viewport_scale[1]);
+    const __m256 lc0 = _mm256_set1_ps(p.lens_center[0]), lc1 = _mm256_set1_ps(p.lens_center[1]);
+    const __m256 warp = _mm256_set1_ps(p.warp_scale), scale = _mm256_set1_ps(p.aberration[channel] * p.warp_scale);
+    const __m256 k0 = _mm256_set1_ps(p.k[0]), k1 = _mm256_set1_ps(p.k[1]), k2 = _mm256_set1_ps(p.k[2]), k3 = _mm256_set1_ps(p.k[3]);
+    const __m256 k0x4 = _mm256_set1_ps(4 * p.k[0]), k1x3 = _mm256_set1_ps(3 * p.k[1]), k2x2 = _mm256_set1_ps(2 * p.k[2]);
+    const __m256 zero = _mm256_setzero_ps(), min_dg = _mm256_set1_ps(kMinUndistortSlope * p.k[3]);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 q0 = _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(u + i), vs0), lc0), scale);
+        __m256 q1 = _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(v + i), vs1), lc1), scale);
+        __m256 q_mag = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(q0, q0), _mm256_mul_ps(q1, q1)));
+
+        __m256 s = _mm256_div_ps(q_mag, k3);
+        for (int it = 0; it < iterations; it++) {
+            __m256 g = _mm256_sub_ps(_mm256_mul_ps(s, _mm256_add_ps(k3, _mm256_mul_ps(s, _mm256_add_ps(k2, _mm256_mul_ps(s, _mm256_add_ps(k1, _mm256_mul_ps(s, k0))))))), q_mag);
+            __m256 dg = _mm256_max_ps(_mm256_add_ps(k3, _mm256_mul_ps(s, _mm256_add_ps(k2x2, _mm256_mul_ps(s, _mm256_add_ps(k1x3, _mm256_mul_ps(s, k0x4)))))), min_dg);
+            s = _mm256_max_ps(_mm256_sub_ps(s, _mm256_div_ps(g, dg)), zero);
+        }
+        __m256 f = _mm256_add_ps(k3, _mm256_mul_ps(s, _mm256_add_ps(k2, _mm256_mul_ps(s, _mm256_add_ps(k1, _mm256_mul_ps(s, k0))))));
+
+        _mm256_storeu_ps(out_u + i, _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(q0, f), warp), lc0), vs0));
+        _mm256_storeu_ps(out_v + i, _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(q1, f), warp), lc1), vs1));
+    }
+    UndistortScalar(p, channel, iterations, u + i, v + i, n - i, out_u + i, out_v + i);
+}
+
+DISTORTION_TARGET("avx512f")
+static void DistortAVX512(const DistortionBatchParams &p, const float *u, const float *v, int n, vr::DistortionCoordinates_t *out)
+{
+    const __m512 vs0 = _mm512_set1_ps(p.viewport_scale[0]), vs1 = _mm512_set1_ps(p.viewport_scale[1]);
+    const __m512 lc0 = _mm512_set1_ps(p.lens_center[0]), lc1 = _mm512_set1_ps(p.lens_center[1]);
+    const __m512 warp = _mm512_set1_ps(p.warp_scale);
+    const __m512 k0 = _mm512_set1_ps(p.k[0]), k1 = _mm512_set1_ps(p.k[1]), k2 = _mm512_set1_ps(p.k[2]), k3 = _mm512_set1_ps(p.k[3]);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 r0 = _mm512_div_ps(_mm512_sub_ps(_mm512_mul_ps(_mm512_loadu_ps(u + i), vs0), lc0), warp);
+        __m512 r1 = _mm512_div_ps(_mm512_sub_ps(_mm512_mul_ps(_mm512_loadu_ps(v + i), vs1), lc1), warp);
+        __m512 r_sq = _mm512_add_ps(_mm512_mul_ps(r0, r0), _mm512_mul_ps(r1, r1));
+        // same as _mm512_sqrt_ps, which trips -Wmaybe-uninitialized in some GCC headers
+        __m512 r_mag = _mm512_mask_sqrt_ps(r_sq, 0xffff, r_sq);
+        __m512 r_scale = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(k3, _mm512_mul_ps(k2, r_mag)),
+                                                     _mm512_mul_ps(_mm512_mul_ps(k1, r_mag), r_mag)),
+                                       _mm512_mul_ps(_mm512_mul_ps(_mm512_mul_ps(k0, r_mag), r_mag), r_mag));
+        __m512 d0 = _mm512_mul_ps(_mm512_mul_ps(r0, r_scale), warp);
+        __m512 d1 = _mm512_mul_ps(_mm512_mul_ps(r1, r_scale), warp);
+
+        float lanes[6 * 16];
+        for (int c = 0; c < 3; c++) {
+            __m512 ab = _mm512_set1_ps(p.aberration[c]);
+            _mm512_storeu_ps(lanes + (2 * c) * 16, _mm512_div_ps(_mm512_add_ps(lc0, _mm512_mul_ps(ab, d0)), vs0));
+            _mm512_storeu_ps(lanes + (2 * c + 1) * 16, _mm512_div_ps(_mm512_add_ps(lc1, _mm512_mul_ps(ab, d1)), vs1));
+        }
+        StoreCoordinates(lanes, 16, out + i);
+    }
+    DistortScalar(p, u + i, v + i, n - i, out + i);
+}
+
+DISTORTION_TARGET("avx512f")
+static void UndistortAVX512(const DistortionBatchParams &p, int channel, int iterations, const float *u, const float *v, int n, float *out_u, float *out_v)
+{
+    const __m512 vs0 = _mm512_set1_ps(p.viewport_scale[0]), vs1 = _mm512_set1_ps(p.viewport_scale[1]);
+    const __m512 lc0 = _mm512_set1_ps(p.lens_center[0]), lc1 = _mm512_set1_ps(p.lens_center[1]);
+    const __m512 warp = _mm512_set1_ps(p.warp_scale), scale = _mm512_set1_ps(p.aberration[channel] * p.warp_scale);
+    const __m512 k0 = _mm512_set1_ps(p.k[0]), k1 = _mm512_set1_ps(p.k[1]), k2 = _mm512_set1_ps(p.k[2]), k3 = _mm512_set1_ps(p.k[3]);
+    const __m512 k0x4 = _mm512_set1_ps(4 * p.k[0]), k1x3 = _mm512_set1_ps(3 * p.k[1]), k2x2 = _mm512_set1_ps(2 * p.k[2]);
+    const __m512 zero = _mm512_setzero_ps(), min_dg = _mm512_set1_ps(kMinUndistortSlope * p.k[3]);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 q0 = _mm512_div_ps(_mm512_sub_ps(_mm512_mul_ps(_mm512_loadu_ps(u + i), vs0), lc0), scale);
+        __m512 q1 = _mm512_div_ps(_mm512_sub_ps(_mm512_mul_ps(_mm512_loadu_ps(v + i), vs1), lc1), scale);
+        __m512 q_sq = _mm512_add_ps(_mm512_mul_ps(q0, q0), _mm512_mul_ps(q1, q1));
+        __m512 q_mag = _mm512_mask_sqrt_ps(q_sq, 0xffff, q_sq);
+
+        __m512 s = _mm512_div_ps(q_mag, k3);
+        for (int it = 0; it < iterations; it++) {
+            __m512 g = _mm512_sub_ps(_mm512_mul_ps(s, _mm512_add_ps(k3, _mm512_mul_ps(s, _mm512_add_ps(k2, _mm512_mul_ps(s, _mm512_add_ps(k1, _mm512_mul_ps(s, k0))))))), q_mag);
+            __m512 dg = _mm512_mask_max_ps(s, 0xffff, _mm512_add_ps(k3, _mm512_mul_ps(s, _mm512_add_ps(k2x2, _mm512_mul_ps(s, _mm512_add_ps(k1x3, _mm512_mul_ps(s, k0x4)))))), min_dg);
+            s = _mm512_mask_max_ps(s, 0xffff, _mm512_sub_ps(s, _mm512_div_ps(g, dg)), zero);
+        }
+        __m512 f = _mm512_add_ps(k3, _mm512_mul_ps(s, _mm512_add_ps(k2, _mm512_mul_ps(s, _mm512_add_ps(k1, _mm512_mul_ps(s, k0))))));
+
+        _mm512_storeu_ps(out_u + i, _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_div_ps(q0, f), warp), lc0), vs0));
+        _mm512_storeu_ps(out_v + i, _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_div_ps(q1, f), warp), lc1), vs1));
+    }
+    UndistortScalar(p, channel, iterations, u + i, v + i, n - i, out_u + i, out_v + i);
+}
+
+enum CpuFeature { Cpu_SSE2, Cpu_AVX2, Cpu_AVX512F };
+
+// also checks that the OS saves the wider registers
+static bool CpuSupports(CpuFeature feature)
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    unsigned long long xcr0 = (info[2] & (1 << 27)) ? _xgetbv(0) : 0;
+    bool avx2 = false, avx512f = false;
+    if (max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+        avx512f = (info[1] & (1 << 16)) != 0;
+    }
+    switch (feature) {
+    case Cpu_SSE2: return sse2;
+    case Cpu_AVX2: return avx && avx2 && (xcr0 & 0x6) == 0x6;
+    case Cpu_AVX512F: return avx512f && (xcr0 & 0xe6) == 0xe6;
+    }
+    return false;
+#else
+    __builtin_cpu_init();
+    switch (feature) {
+    case Cpu_SSE2: return __builtin_cpu_supports("sse2");
+    case Cpu_AVX2: return __builtin_cpu_supports("avx2");
+    case Cpu_AVX512F: return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+#endif
+}
+
+#endif // DISTORTION_BATCH_X86
+
+struct DistortKernelInfo
+{
+    const char *name;
+    DistortKernel kernel;
+    UndistortKernel undistort;
+    bool supported;
+};
+
+// widest first
+static std::vector<DistortKernelInfo> SupportedKernels()
+{
+    std::vector<DistortKernelInfo> kernels;
+#ifdef DISTORTION_BATCH_X86
+    DistortKernelInfo avx512 = { "avx512", DistortAVX512, UndistortAVX512, CpuSupports(Cpu_AVX512F) };
+    DistortKernelInfo avx2 = { "avx2", DistortAVX2, UndistortAVX2, CpuSupports(Cpu_AVX2) };
+    DistortKernelInfo sse2 = { "sse2", DistortSSE2, UndistortSSE2, CpuSupports(Cpu_SSE2) };
+    kernels.push_back(avx512);
+    kernels.push_back(avx2);
+    kernels.push_back(sse2);
+#endif
+    DistortKernelInfo scalar = { "scalar", DistortScalar, UndistortScalar, true };
+    kernels.push_back(scalar);
+    return kernels;
+}
+
+static DistortKernelInfo SelectKernel()
+{
+    std::vector<DistortKernelInfo> kernels = SupportedKernels();
+    for (size_t i = 0; i < kernels.size(); i++) {
+        if (kernels[i].supported)
+            return kernels[i];
+    }
+    return kernels.back();
+}
+
+static const DistortKernelInfo s_kernel = SelectKernel();
+
+void DistortBatch(const DistortionBatchParams &params, const float *u, const float *v, int n, vr::DistortionCoordinates_t *out)
+{
+    s_kernel.kernel(params, u, v, n, out);
+}
+
+void UndistortBatch(const DistortionBatchParams &params, int channel, const float *u, const float *v, int n, float *out_u, float *out_v)
+{
+    if (!UndistortDefined(params, channel)) {
+        for (int i = 0; i < n; i++) {
+            out_u[i] = u[i];
+            out_v[i] = v[i];
+        }
+        return;
+    }
+    s_kernel.undistort(params, channel, UndistortIterations(params, channel), u, v, n, out_u, out_v);
+}
+
+const char *DistortBatchKernelName()
+{
+    return s_kernel.name;
+}
+
+void BenchmarkDistortBatch(const DistortionBatchParams &params)
+{
+    const int side = 512;
+    const int n = side * side;
+    std::vector<float> u(n), v(n);
+    for (int i = 0; i < n; i++) {
+        u[i] = (i % side) / (float) (side - 1);
+        v[i] = (i / side) / (float) (side - 1);
+    }
+
+    std::vector<vr::DistortionCoordinates_t> reference(n), out(n);
+    DistortScalar(params, u.data(), v.data(), n, reference.data());
+
+    std::vector<DistortKernelInfo> kernels = SupportedKernels();
+    for (size_t k = 0; k < kernels.size(); k++) {
+        if (!kernels[k].supported)
+            continue;
+
+        // best of a few runs, the first one also pages in the buffers
+        double best = 1e30;
+        for (int run = 0; run < 5; run++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            kernels[k].kernel(params, u.data(), v.data(), n, out.data());
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (seconds < best)
+                best = seconds;
+        }
+
+        float maxDiff = 0;
+        for (int i = 0; i < n; i++) {
+            const float *a = &reference[i].rfRed[0], *b = &out[i].rfRed[0];
+            for (int c = 0; c < 6; c++)
+                maxDiff = fmaxf(maxDiff, fabsf(a[c] - b[c]));
+        }
+
+        DriverLog("driver_openhmd: distortion kernel %s%s: %.1f Msamples/s, max difference to scalar %g\n",
+                  kernels[k].name, kernels[k].kernel == s_kernel.kernel ? " (used)" : "",
+                  n / best * 1e-6, maxDiff);
+    }
+}
+
+void BenchmarkUndistortBatch(const DistortionBatchParams &params, float pixels_u, float pixels_v)
+{
+    for (int c = 0; c < 3; c++) {
+        if (!UndistortDefined(params, c)) {
+            DriverLog("driver_openhmd: lens model has no inverse, skipping the undistortion benchmark\n");
+            return;
+        }
+    }
+
+    const int side = 512;
+    const int n = side * side;
+    std::vector<float> u(n), v(n);
+    for (int i = 0; i < n; i++) {
+        u[i] = (i % side) / (float) (side - 1);
+        v[i] = (i / side) / (float) (side - 1);
+    }
+
+    // the distorted UVs of every channel, as input to the inverse
+    std::vector<vr::DistortionCoordinates_t> distorted(n);
+    DistortScalar(params, u.data(), v.data(), n, distorted.data());
+    std::vector<float> du[3], dv[3];
+    for (int c = 0; c < 3; c++) {
+        du[c].resize(n);
+        dv[c].resize(n);
+        for (int i = 0; i < n; i++) {
+            const float *coordinates = &distorted[i].rfRed[0];
+            du[c][i] = coordinates[2 * c];
+            dv[c][i] = coordinates[2 * c + 1];
+        }
+    }
+
+    std::vector<float> out_u(n), out_v(n);
+    std::vector<DistortKernelInfo> kernels = SupportedKernels();
+    for (size_t k = 0; k < kernels.size(); k++) {
+        if (!kernels[k].supported)
+            continue;
+
+        double best = 1e30;
+        for (int run = 0; run < 5; run++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            kernels[k].undistort(params, 1, UndistortIterations(params, 1), du[1].data(), dv[1].data(), n, out_u.data(), out_v.data());
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (seconds < best)
+                best = seconds;
+        }
+
+        double maxError = 0, sumError = 0;
+        for (int c = 0; c < 3; c++) {
+            kernels[k].undistort(params, c, UndistortIterations(params, c), du[c].data(), dv[c].data(), n, out_u.data(), out_v.data());
+            for (int i = 0; i < n; i++) {
+                double eu = (out_u[i] - u[i]) * pixels_u, ev = (out_v[i] - v[i]) * pixels_v;
+                double e = sqrt(eu * eu + ev * ev);
+                maxError = e > maxError ? e : maxError;
+                sumError += e;
+            }
+        }
+
+        DriverLog("driver_openhmd: undistortion kernel %s%s: %d iterations, %.1f Msamples/s, round trip max error %.2g px, mean error %.2g px\n",
+                  kernels[k].name, kernels[k].kernel == s_kernel.kernel ? " (used)" : "",
+                  UndistortIterations(params, 1), n / best * 1e-6, maxError, sumError / (3.0 * n));
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef DISTORTION_BATCH_H
+#define DISTORTION_BATCH_H
+
+#pragma once
+
+#include <openvr_driver.h>
+
+// Constants of the lens model for one eye, see DistortionModel.
+struct DistortionBatchParams
+{
+    float lens_center[2];
+    float viewport_scale[2];
+    float warp_scale;
+    float k[4];          // OHMD_UNIVERSAL_DISTORTION_K
+    float aberration[3]; // OHMD_UNIVERSAL_ABERRATION_K, red, green, blue
+};
+
+// Distorts n UVs of one eye. Uses the widest SIMD kernel the CPU supports (SSE2, AVX2 or
+// AVX-512 on x86, scalar code elsewhere), chosen once when the driver is loaded.
+void DistortBatch(const DistortionBatchParams &params, const float *u, const float *v, int n, vr::DistortionCoordinates_t *out);
+
+// Inverse of DistortBatch for one color channel (0 red, 1 green, 2 blue): finds the UVs that
+// distort to u, v. The radial model is inverted with Newton iterations on the distance from the
+// lens center, as many as the corners of the viewport need, for all points of the batch. A model
+// without an inverse (k3 <= 0 or a zero scale) leaves u, v unchanged.
+void UndistortBatch(const DistortionBatchParams &params, int channel, const float *u, const float *v, int n, float *out_u, float *out_v);
+
+// name of the kernel DistortBatch uses
+const char *DistortBatchKernelName();
+
+// logs the throughput of every kernel the CPU supports, and its largest difference to the
+// scalar kernel
+void BenchmarkDistortBatch(const DistortionBatchParams &params);
+
+// logs the throughput of every UndistortBatch kernel the CPU supports, and the error of
+// undistorting the distorted UVs of the whole viewport, in pixels with the given number of
+// pixels per unit of u and v
+void BenchmarkUndistortBatch(const DistortionBatchParams &params, float pixels_u, float pixels_v);
+
+#endif // DISTORTION_BATCH_H
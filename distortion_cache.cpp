@@ -0,0 +1,154 @@
+#include "distortion_cache.h"
+#include "driverlog.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined( _WIN32 )
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+static const char kMagic[8] = { 'O', 'H', 'M', 'D', 'D', 'I', 'S', 'T' };
+static const uint32_t kVersion = 1;
+
+struct DistortionCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t grid_size;
+    uint64_t key;
+    uint64_t grid_bytes;
+    uint64_t grid_hash;
+    uint64_t header_hash; // of all fields above
+};
+
+static uint64_t HeaderHash(const DistortionCacheHeader &header)
+{
+    return DistortionCacheHash(&header, offsetof(DistortionCacheHeader, header_hash));
+}
+
+uint64_t DistortionCacheHash(const void *data, size_t size, uint64_t hash)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static std::string CacheDirectory()
+{
+#if defined( _WIN32 )
+    const char *base = getenv("LOCALAPPDATA");
+    if (!base || !*base)
+        return std::string();
+    std::string dir = std::string(base) + "\\SteamVR-OpenHMD";
+    CreateDirectoryA(dir.c_str(), NULL);
+    return dir + "\\";
+#else
+    std::string base;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+#if defined( __APPLE__ )
+    xdg = NULL;
+#endif
+    if (xdg && *xdg) {
+        base = xdg;
+    } else if (home && *home) {
+#if defined( __APPLE__ )
+        base = std::string(home) + "/Library/Caches";
+#else
+        base = std::string(home) + "/.cache";
+#endif
+    } else {
+        return std::string();
+    }
+    mkdir(base.c_str(), 0700);
+    std::string dir = base + "/steamvr-openhmd";
+    mkdir(dir.c_str(), 0700);
+    return dir + "/";
+#endif
+}
+
+std::string DistortionCachePath(const std::string &device_id)
+{
+    std::string dir = CacheDirectory();
+    if (dir.empty())
+        return dir;
+
+    char name[64];
+    snprintf(name, sizeof(name), "distortion-%016llx.bin", (unsigned long long) DistortionCacheHash(device_id.data(), device_id.size()));
+    return dir + name;
+}
+
+bool ReadDistortionCache(const std::string &path, uint64_t key, int grid_size, std::vector<vr::DistortionCoordinates_t> &grid)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+
+    DistortionCacheHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        return false;
+    }
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.header_hash != HeaderHash(header)) {
+        DriverLog("driver_openhmd: ignoring damaged distortion cache %s\n", path.c_str());
+        fclose(f);
+        return false;
+    }
+    if (header.version != kVersion || header.key != key || header.grid_size != (uint32_t) grid_size) {
+        fclose(f);
+        return false;
+    }
+
+    // read straight into the grid, a file that is too short or doesn't match its hash leaves it empty
+    size_t count = 2 * (size_t) (grid_size + 1) * (grid_size + 1);
+    bool ok = header.grid_bytes == count * sizeof(vr::DistortionCoordinates_t);
+    if (ok) {
+        grid.resize(count);
+        ok = fread(grid.data(), (size_t) header.grid_bytes, 1, f) == 1 &&
+             header.grid_hash == DistortionCacheHash(grid.data(), (size_t) header.grid_bytes);
+    }
+    fclose(f);
+    if (!ok) {
+        grid.clear();
+        DriverLog("driver_openhmd: ignoring damaged distortion cache %s\n", path.c_str());
+    }
+    return ok;
+}
+
+bool WriteDistortionCache(const std::string &path, uint64_t key, int grid_size, const std::vector<vr::DistortionCoordinates_t> &grid)
+{
+    DistortionCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.grid_size = grid_size;
+    header.key = key;
+    header.grid_bytes = grid.size() * sizeof(vr::DistortionCoordinates_t);
+    header.grid_hash = DistortionCacheHash(grid.data(), (size_t) header.grid_bytes);
+    header.header_hash = HeaderHash(header);
+
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(grid.data(), (size_t) header.grid_bytes, 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+
+#if defined( _WIN32 )
+    ok = ok && MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok)
+        remove(tmp.c_str());
+    return ok;
+}
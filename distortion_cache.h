@@ -0,0 +1,33 @@
+#ifndef DISTORTION_CACHE_H
+#define DISTORTION_CACHE_H
+
+#pragma once
+
+#include <openvr_driver.h>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// On disk cache of precomputed distortion grids, so a restart of SteamVR with the same headset
+// doesn't evaluate the grid again.
+// There is one file per headset, named after a hash of device_id, in the user's cache directory
+// ($XDG_CACHE_HOME or ~/.cache on Linux, ~/Library/Caches on macOS, %LOCALAPPDATA% on Windows).
+// The file starts with a versioned header holding the key of the optical parameters the grid
+// was computed from and checksums of header and grid. A file with the wrong version, key or
+// grid size, or a bad checksum, is ignored and overwritten with the new grid.
+
+// 64 bit FNV-1a, chain calls by passing the previous result as hash
+uint64_t DistortionCacheHash(const void *data, size_t size, uint64_t hash = 14695981039346656037ull);
+
+// path of the cache file for device_id, empty if there is no cache directory
+std::string DistortionCachePath(const std::string &device_id);
+
+// Reads the grid straight into grid. Returns false if the file is missing or doesn't match key
+// and grid_size.
+bool ReadDistortionCache(const std::string &path, uint64_t key, int grid_size, std::vector<vr::DistortionCoordinates_t> &grid);
+
+// replaces the file atomically, so readers never see a partially written file
+bool WriteDistortionCache(const std::string &path, uint64_t key, int grid_size, const std::vector<vr::DistortionCoordinates_t> &grid);
+
+#endif // DISTORTION_CACHE_H
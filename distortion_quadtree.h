@@ -0,0 +1,188 @@
+#ifndef DISTORTION_QUADTREE_H
+#define DISTORTION_QUADTREE_H
+
+#pragma once
+
+#include "distortion_batch.h"
+
+#include <vector>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// Adaptive alternative to the uniform distortion grid. Each eye's viewport is the root of a
+// quadtree whose cells are split until bilinear interpolation between the cell corners is
+// within a tolerance of the exact lens model, or the cell reaches 1/max_resolution of the
+// viewport. The lens center, where the distortion is nearly linear, ends up with a few big
+// cells and the periphery with small ones. Corners shared by neighboring cells are stored once.
+class DistortionQuadtree
+{
+public:
+    DistortionQuadtree() : m_resolution(0), m_tolerance(0), m_params(NULL)
+    {
+        m_pixels[0] = m_pixels[1] = 0;
+        m_root[0] = m_root[1] = 0;
+    }
+
+    bool Empty() const { return m_nodes.empty(); }
+
+    // max_resolution is rounded up to a power of two, tolerance is in pixels with the given
+    // number of pixels per unit of u and v
+    void Build(const DistortionBatchParams *eyes, int max_resolution, float tolerance, float pixels_u, float pixels_v)
+    {
+        m_resolution = 1;
+        while (m_resolution < max_resolution && m_resolution < kMaxResolution)
+            m_resolution *= 2;
+        m_tolerance = tolerance;
+        m_pixels[0] = pixels_u;
+        m_pixels[1] = pixels_v;
+        m_nodes.clear();
+        m_vertices.clear();
+
+        for (int eye = 0; eye < 2; eye++) {
+            m_params = &eyes[eye];
+            m_vertexIndex.assign((size_t) (m_resolution + 1) * (m_resolution + 1), -1);
+            m_root[eye] = (int) m_nodes.size();
+            m_nodes.push_back(Node());
+            Subdivide(m_root[eye], 0, 0, m_resolution);
+        }
+        m_vertexIndex.clear();
+        m_vertexIndex.shrink_to_fit();
+        m_params = NULL;
+    }
+
+    vr::DistortionCoordinates_t Sample(int eye, float u, float v) const
+    {
+        const Node *node = &m_nodes[m_root[eye]];
+        while (node->child >= 0) {
+            int quadrant = 0;
+            u *= 2;
+            v *= 2;
+            if (u >= 1) {
+                u -= 1;
+                quadrant |= 1;
+            }
+            if (v >= 1) {
+                v -= 1;
+                quadrant |= 2;
+            }
+            node = &m_nodes[node->child + quadrant];
+        }
+        return Bilinear(node->vertex, u, v);
+    }
+
+    int LeafCount() const
+    {
+        int leaves = 0;
+        for (size_t i = 0; i < m_nodes.size(); i++)
+            leaves += m_nodes[i].child < 0;
+        return leaves;
+    }
+
+    int VertexCount() const { return (int) m_vertices.size(); }
+    int Resolution() const { return m_resolution; }
+    size_t MemoryBytes() const { return m_nodes.size() * sizeof(Node) + m_vertices.size() * sizeof(vr::DistortionCoordinates_t); }
+
+private:
+    static const int kMaxResolution = 1024;
+    static const int kCoordinateFloats = sizeof(vr::DistortionCoordinates_t) / sizeof(float);
+
+    // children are stored consecutively, in the order top left, top right, bottom left, bottom right
+    struct Node
+    {
+        int child;     // index of the first child, -1 for a leaf
+        int vertex[4]; // corners of a leaf, in the same order as the children
+        Node() : child(-1) { vertex[0] = vertex[1] = vertex[2] = vertex[3] = -1; }
+    };
+
+    vr::DistortionCoordinates_t Bilinear(const int *vertex, float fx, float fy) const
+    {
+        const float *c00 = &m_vertices[vertex[0]].rfRed[0];
+        const float *c10 = &m_vertices[vertex[1]].rfRed[0];
+        const float *c01 = &m_vertices[vertex[2]].rfRed[0];
+        const float *c11 = &m_vertices[vertex[3]].rfRed[0];
+
+        float out[kCoordinateFloats];
+        for (int k = 0; k < kCoordinateFloats; k++) {
+            float top = c00[k] + (c10[k] - c00[k]) * fx;
+            float bottom = c01[k] + (c11[k] - c01[k]) * fx;
+            out[k] = top + (bottom - top) * fy;
+        }
+        vr::DistortionCoordinates_t coordinates;
+        memcpy(&coordinates, out, sizeof(coordinates));
+        return coordinates;
+    }
+
+    // index of the exact model at grid point (i, j) of the finest level
+    int Vertex(int i, int j)
+    {
+        int &index = m_vertexIndex[(size_t) j * (m_resolution + 1) + i];
+        if (index < 0) {
+            float u = (float) i / m_resolution, v = (float) j / m_resolution;
+            vr::DistortionCoordinates_t coordinates;
+            DistortBatch(*m_params, &u, &v, 1, &coordinates);
+            index = (int) m_vertices.size();
+            m_vertices.push_back(coordinates);
+        }
+        return index;
+    }
+
+    // largest error of bilinear interpolation in the cell on a 4x4 set of interior points
+    float CellError(const int *vertex, int i0, int j0, int size)
+    {
+        const int n = 4;
+        float u[n * n], v[n * n];
+        vr::DistortionCoordinates_t exact[n * n];
+        for (int k = 0; k < n * n; k++) {
+            u[k] = (i0 + size * ((k % n) + 0.5f) / n) / m_resolution;
+            v[k] = (j0 + size * ((k / n) + 0.5f) / n) / m_resolution;
+        }
+        DistortBatch(*m_params, u, v, n * n, exact);
+
+        float maxError = 0;
+        for (int k = 0; k < n * n; k++) {
+            vr::DistortionCoordinates_t approx = Bilinear(vertex, ((k % n) + 0.5f) / n, ((k / n) + 0.5f) / n);
+            const float *a = &exact[k].rfRed[0], *b = &approx.rfRed[0];
+            for (int c = 0; c < kCoordinateFloats; c += 2) {
+                float du = (a[c] - b[c]) * m_pixels[0], dv = (a[c + 1] - b[c + 1]) * m_pixels[1];
+                float e = du * du + dv * dv;
+                if (e > maxError)
+                    maxError = e;
+            }
+        }
+        return sqrtf(maxError);
+    }
+
+    void Subdivide(int node, int i0, int j0, int size)
+    {
+        int vertex[4] = { Vertex(i0, j0), Vertex(i0 + size, j0), Vertex(i0, j0 + size), Vertex(i0 + size, j0 + size) };
+        if (size == 1 || CellError(vertex, i0, j0, size) <= m_tolerance) {
+            memcpy(m_nodes[node].vertex, vertex, sizeof(vertex));
+            return;
+        }
+
+        int child = (int) m_nodes.size();
+        m_nodes[node].child = child;
+        for (int q = 0; q < 4; q++)
+            m_nodes.push_back(Node());
+
+        int half = size / 2;
+        Subdivide(child + 0, i0, j0, half);
+        Subdivide(child + 1, i0 + half, j0, half);
+        Subdivide(child + 2, i0, j0 + half, half);
+        Subdivide(child + 3, i0 + half, j0 + half, half);
+    }
+
+    int m_resolution;
+    float m_tolerance;
+    float m_pixels[2];
+    int m_root[2];
+    std::vector<Node> m_nodes;
+    std::vector<vr::DistortionCoordinates_t> m_vertices;
+
+    // only while building
+    const DistortionBatchParams *m_params;
+    std::vector<int> m_vertexIndex;
+};
+
+#endif // DISTORTION_QUADTREE_H
@@ -0,0 +1,560 @@
+// Microbenchmarks of the driver's hot paths. Not part of the driver, run
+//   driver_benchmark [name...]
+// to run all benchmarks or only the named ones.
+
+#include "driverlog.h"
+#include "distortion.h"
+#include "input_dispatch.h"
+#include "ohmd_math.h"
+#include "panel_rotation.h"
+#include "pose_filter.h"
+#include "pose_history.h"
+#include "pose_snapshot.h"
+
+#include <openhmd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#define BENCHMARK_NOINLINE __declspec(noinline)
+#else
+#define BENCHMARK_NOINLINE __attribute__((noinline))
+#endif
+
+// DriverLog output of the driver code under test goes to stdout
+class StdoutDriverLog : public vr::IVRDriverLog
+{
+public:
+    void Log(const char *pchLogMessage) override { fputs(pchLogMessage, stdout); }
+};
+
+// The first HMD OpenHMD finds, with the dummy HMD of OpenHMD if nothing is connected. Opened on
+// first use and kept open until exit, NULL if there is none.
+static ohmd_device *BenchmarkHmd()
+{
+    static ohmd_context *ctx = NULL;
+    static ohmd_device *hmd = NULL;
+    if (ctx)
+        return hmd;
+
+    ctx = ohmd_ctx_create();
+    int num_devices = ohmd_ctx_probe(ctx);
+    for (int i = 0; i < num_devices && !hmd; i++) {
+        int device_class = 0;
+        ohmd_list_geti(ctx, i, OHMD_DEVICE_CLASS, &device_class);
+        if (device_class == OHMD_DEVICE_CLASS_HMD) {
+            hmd = ohmd_list_open_device(ctx, i);
+            if (hmd)
+                printf("lens model of %s %s\n", ohmd_list_gets(ctx, i, OHMD_VENDOR), ohmd_list_gets(ctx, i, OHMD_PRODUCT));
+        }
+    }
+    if (!hmd)
+        printf("no HMD found, skipping\n");
+    return hmd;
+}
+
+// p50, p90, p99 and max of samples in nanoseconds, sorts samples
+static void PrintPercentiles(const char *name, std::vector<int64_t> &samples)
+{
+    if (samples.empty())
+        return;
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    printf("%-44s n=%zu p50=%lldns p90=%lldns p99=%lldns max=%lldns\n", name, n, (long long) samples[n / 2],
+           (long long) samples[n * 9 / 10], (long long) samples[n * 99 / 100], (long long) samples[n - 1]);
+}
+
+// Latency of PoseSnapshot::Load while one thread stores at the tracking rate or as fast as it
+// can, and the number of torn reads, which has to be 0.
+static void BenchmarkSeqLock()
+{
+    const int64_t durationNs = 500000000;
+    const int64_t writePeriods[] = { 1000000, 0 }; // 1 kHz, flat out
+    const int readerCounts[] = { 1, 3 };
+
+    for (int64_t period : writePeriods) {
+        for (int readers : readerCounts) {
+            PoseSnapshot snapshot;
+            std::atomic<bool> running(true);
+            std::atomic<uint64_t> torn(0), writes(0);
+
+            // every field of a sample is its sequence number, so a torn read has different fields
+            std::thread writer([&]() {
+                int64_t next = PoseClockNow();
+                for (int64_t seq = 1; running.load(std::memory_order_relaxed); seq++) {
+                    PoseSample sample;
+                    for (int i = 0; i < 4; i++)
+                        sample.quat[i] = (float) seq;
+                    for (int i = 0; i < 3; i++)
+                        sample.pos[i] = sample.vel[i] = sample.angvel[i] = (float) seq;
+                    sample.time = seq;
+                    snapshot.Store(sample);
+                    writes++;
+                    if (period > 0) {
+                        next += period;
+                        while (PoseClockNow() < next && running.load(std::memory_order_relaxed))
+                            std::this_thread::yield();
+                    }
+                }
+            });
+
+            std::vector<std::vector<int64_t> > latencies(readers);
+            std::vector<std::thread> pool;
+            for (int r = 0; r < readers; r++) {
+                pool.push_back(std::thread([&, r]() {
+                    std::vector<int64_t> &samples = latencies[r];
+                    samples.reserve(1 << 20);
+                    while (running.load(std::memory_order_relaxed) && samples.size() < samples.capacity()) {
+                        int64_t start = PoseClockNow();
+                        PoseSample sample = snapshot.Load();
+                        samples.push_back(PoseClockNow() - start);
+                        if (sample.quat[0] != (float) sample.time || sample.angvel[2] != (float) sample.time)
+                            torn++;
+                    }
+                }));
+            }
+
+            std::this_thread::sleep_for(std::chrono::nanoseconds(durationNs));
+            running = false;
+            writer.join();
+            for (std::thread &t : pool)
+                t.join();
+
+            std::vector<int64_t> all;
+            for (const std::vector<int64_t> &samples : latencies)
+                all.insert(all.end(), samples.begin(), samples.end());
+
+            char name[96];
+            snprintf(name, sizeof(name), "seqlock read, %s writer, %d reader%s", period > 0 ? "1 kHz" : "flat out",
+                     readers, readers > 1 ? "s" : "");
+            PrintPercentiles(name, all);
+            printf("%-44s writes=%llu torn=%llu\n", "", (unsigned long long) writes.load(), (unsigned long long) torn.load());
+        }
+    }
+}
+
+// Cost of PoseHistory::PoseAt on a full history of samples 1 ms apart, for queries anywhere in
+// it (binary search and interpolation), in the newest interval, and past the newest sample.
+static void BenchmarkPoseHistory()
+{
+    PoseHistory history;
+    const int64_t interval = 1000000;
+    for (int i = 0; i < 2 * PoseHistory::kCapacity; i++) {
+        // turning about y at 1 rad/s and moving along x at 1 m/s
+        PoseSample sample = PoseSample();
+        float angle = i * 0.001f;
+        sample.quat[1] = sinf(angle / 2);
+        sample.quat[3] = cosf(angle / 2);
+        sample.pos[0] = angle;
+        sample.time = i * interval;
+        history.Push(sample);
+        history.EstimateVelocity(10 * interval);
+    }
+
+    const int64_t oldest = history.Get(history.Count() - 1).time, newest = history.Get(0).time;
+    const int queries = 1 << 16;
+    std::vector<int64_t> anywhere(queries), latest(queries), ahead(queries);
+    uint32_t random = 12345;
+    for (int i = 0; i < queries; i++) {
+        random = random * 1664525u + 1013904223u;
+        anywhere[i] = oldest + (int64_t) (random % (uint32_t) (newest - oldest));
+        latest[i] = newest - interval + (int64_t) (random % (uint32_t) interval);
+        ahead[i] = newest + (int64_t) (random % (uint32_t) (2 * interval));
+    }
+
+    const struct { const char *name; const std::vector<int64_t> *times; } cases[] = {
+        { "pose history query anywhere", &anywhere },
+        { "pose history query in the newest interval", &latest },
+        { "pose history query past the newest sample", &ahead },
+    };
+    for (const auto &c : cases) {
+        double best = 1e30;
+        float sink = 0;
+        for (int run = 0; run < 5; run++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int64_t time : *c.times)
+                sink += history.PoseAt(time).pos[0];
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            best = std::min(best, seconds);
+        }
+        printf("%-44s %.1f ns (checksum %g)\n", c.name, best / queries * 1e9, sink);
+    }
+}
+
+// Cost of PoseFilterBank::Apply per device and frame, with the default filter parameters, for
+// every combination of the stages and 1, 3 and 16 devices, all updated at 1 kHz with noise.
+static void BenchmarkPoseFilter()
+{
+    PoseFilterParams params;
+    params.exponential_cutoff = 10.0f;
+    params.oneeuro_min_cutoff = 1.0f;
+    params.oneeuro_beta = 0.5f;
+    params.oneeuro_d_cutoff = 1.0f;
+    params.kalman_process_noise = 1.0f;
+    params.kalman_measurement_noise = 0.00001f;
+
+    const char *const stages[] = { "exponential", "oneeuro", "kalman" };
+    const int deviceCounts[] = { 1, 3, DeviceStateStore::kMaxDevices };
+    const int frames = 20000;
+    const int64_t interval = 1000000;
+
+    for (int combination = 1; combination < 8; combination++) {
+        std::string chain;
+        for (int s = 0; s < 3; s++) {
+            if (combination & (1 << s))
+                chain += (chain.empty() ? "" : ",") + std::string(stages[s]);
+        }
+        for (int devices : deviceCounts) {
+            DeviceStateStore store;
+            int slots[DeviceStateStore::kMaxDevices];
+            const float origin[3] = { 0, 0, 0 };
+            for (int i = 0; i < devices; i++)
+                slots[i] = store.AddDevice(NULL, false, false, origin);
+
+            PoseFilterBank bank;
+            bank.Configure("benchmark", chain, params);
+
+            uint32_t random = 12345;
+            double best = 1e30;
+            for (int run = 0; run < 5; run++) {
+                double seconds = 0;
+                for (int f = 0; f < frames; f++) {
+                    // a slow turn about y and a slow move along x, with sensor noise
+                    float angle = f * 0.0005f;
+                    for (int i = 0; i < devices; i++) {
+                        random = random * 1664525u + 1013904223u;
+                        float noise = ((random >> 8) / 16777216.0f - 0.5f) * 0.002f;
+                        int slot = slots[i];
+                        store.qx[slot] = noise;
+                        store.qy[slot] = sinf(angle / 2);
+                        store.qz[slot] = -noise;
+                        store.qw[slot] = cosf(angle / 2);
+                        store.px[slot] = angle + noise;
+                        store.py[slot] = 1.5f - noise;
+                        store.pz[slot] = noise;
+                        store.time[slot] = ((int64_t) run * frames + f) * interval;
+                    }
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    bank.Apply(store, slots, devices);
+                    seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                }
+                best = std::min(best, seconds);
+            }
+
+            char name[96];
+            snprintf(name, sizeof(name), "%s, %d device%s", chain.c_str(), devices, devices > 1 ? "s" : "");
+            printf("%-44s %.1f ns per device and frame, %.3f%% of a 1 kHz frame for all\n", name,
+                   best / frames / devices * 1e9, best / frames / 1e-3 * 100);
+        }
+    }
+}
+
+// The scalar code ohmd_math.h replaced, as the baseline of BenchmarkMath
+namespace old_math
+{
+inline void quat_mult(const float *a, const float *b, float *q)
+{
+    float x = a[3] * b[0] + a[0] * b[3] + a[1] * b[2] - a[2] * b[1];
+    float y = a[3] * b[1] - a[0] * b[2] + a[1] * b[3] + a[2] * b[0];
+    float z = a[3] * b[2] + a[0] * b[1] - a[1] * b[0] + a[2] * b[3];
+    float w = a[3] * b[3] - a[0] * b[0] - a[1] * b[1] - a[2] * b[2];
+    q[0] = x; q[1] = y; q[2] = z; q[3] = w;
+}
+
+inline void quat_slerp(const float *a, const float *b, float t, float *q)
+{
+    float dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+    float sign = dot < 0 ? -1.f : 1.f;
+    dot *= sign;
+
+    float wa, wb;
+    if (dot > 0.9995f) {
+        wa = 1.f - t;
+        wb = t;
+    } else {
+        float theta = acosf(dot);
+        float s = 1.f / sinf(theta);
+        wa = sinf((1.f - t) * theta) * s;
+        wb = sinf(t * theta) * s;
+    }
+    wb *= sign;
+
+    float len = 0;
+    for (int i = 0; i < 4; i++) {
+        q[i] = wa * a[i] + wb * b[i];
+        len += q[i] * q[i];
+    }
+    len = 1.f / sqrtf(len);
+    for (int i = 0; i < 4; i++)
+        q[i] *= len;
+}
+
+inline void omat4x4f_mult(const mat4x4f *l, const mat4x4f *r, mat4x4f *o)
+{
+    for (int i = 0; i < 4; i++) {
+        float a0 = l->m[i][0], a1 = l->m[i][1], a2 = l->m[i][2], a3 = l->m[i][3];
+        o->m[i][0] = a0 * r->m[0][0] + a1 * r->m[1][0] + a2 * r->m[2][0] + a3 * r->m[3][0];
+        o->m[i][1] = a0 * r->m[0][1] + a1 * r->m[1][1] + a2 * r->m[2][1] + a3 * r->m[3][1];
+        o->m[i][2] = a0 * r->m[0][2] + a1 * r->m[1][2] + a2 * r->m[2][2] + a3 * r->m[3][2];
+        o->m[i][3] = a0 * r->m[0][3] + a1 * r->m[1][3] + a2 * r->m[2][3] + a3 * r->m[3][3];
+    }
+}
+
+// the if-chain that switched row-major and column-major indices
+inline int f2(int i, int j)
+{
+    if (i == 0 && j == 0) return 0;
+    if (i == 0 && j == 1) return 4;
+    if (i == 0 && j == 2) return 8;
+    if (i == 0 && j == 3) return 12;
+
+    if (i == 1 && j == 0) return 1;
+    if (i == 1 && j == 1) return 5;
+    if (i == 1 && j == 2) return 9;
+    if (i == 1 && j == 3) return 13;
+
+    if (i == 2 && j == 0) return 2;
+    if (i == 2 && j == 1) return 6;
+    if (i == 2 && j == 2) return 10;
+    if (i == 2 && j == 3) return 14;
+
+    if (i == 3 && j == 0) return 3;
+    if (i == 3 && j == 1) return 7;
+    if (i == 3 && j == 2) return 11;
+    if (i == 3 && j == 3) return 15;
+
+    return -1;
+}
+}
+
+// best time of 5 runs of fn in ns per op
+template <typename Fn> static double BestNsPerOp(int ops, Fn fn)
+{
+    double best = 1e30;
+    for (int run = 0; run < 5; run++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best / ops * 1e9;
+}
+
+// ohmd_math.h against the scalar code it replaced: quaternion multiply and slerp, matrix
+// multiply and index lookups, with the largest difference of the results
+static void BenchmarkMath()
+{
+    const int n = 1 << 12;
+    std::vector<quatf> qa(n), qb(n), qout(n), qold(n);
+    std::vector<mat4x4f> ma(n), mb(n), mout(n), mold(n);
+    std::vector<float> t(n);
+    std::vector<int> rows(n), cols(n);
+    uint32_t random = 12345;
+    auto next = [&random]() { random = random * 1664525u + 1013904223u; return (random >> 8) / 16777216.0f * 2 - 1; };
+    for (int i = 0; i < n; i++) {
+        quatf a = { next(), next(), next(), next() }, b = { next(), next(), next(), next() };
+        qa[i] = quatf_normalize(a);
+        qb[i] = quatf_normalize(b);
+        for (int k = 0; k < 16; k++) {
+            ma[i].arr[k] = next();
+            mb[i].arr[k] = next();
+        }
+        t[i] = next() * 0.5f + 0.5f;
+        rows[i] = random % 4;
+        cols[i] = (random >> 2) % 4;
+    }
+
+    auto quatDiff = [&]() {
+        float diff = 0;
+        for (int i = 0; i < n; i++)
+            diff = std::max(diff, std::max(std::max(fabsf(qout[i].x - qold[i].x), fabsf(qout[i].y - qold[i].y)), std::max(fabsf(qout[i].z - qold[i].z), fabsf(qout[i].w - qold[i].w))));
+        return diff;
+    };
+
+    double oldNs = BestNsPerOp(n, [&]() { for (int i = 0; i < n; i++) old_math::quat_mult(&qa[i].x, &qb[i].x, &qold[i].x); });
+    double newNs = BestNsPerOp(n, [&]() { for (int i = 0; i < n; i++) qout[i] = quatf_mult(qa[i], qb[i]); });
+    printf("%-44s old %.1f ns, new %.1f ns, max difference %g\n", "quaternion multiply", oldNs, newNs, quatDiff());
+
+    oldNs = BestNsPerOp(n, [&]() { for (int i = 0; i < n; i++) old_math::quat_slerp(&qa[i].x, &qb[i].x, t[i], &qold[i].x); });
+    newNs = BestNsPerOp(n, [&]() { for (int i = 0; i < n; i++) qout[i] = quatf_slerp(qa[i], qb[i], t[i]); });
+    printf("%-44s old %.1f ns, new %.1f ns, max difference %g\n", "quaternion slerp", oldNs, newNs, quatDiff());
+
+    oldNs = BestNsPerOp(n, [&]() { for (int i = 0; i < n; i++) old_math::omat4x4f_mult(&ma[i], &mb[i], &mold[i]); });
+    newNs = BestNsPerOp(n, [&]() { for (int i = 0; i < n; i++) mat4x4f_mult(ma[i], mb[i], &mout[i]); });
+    float diff = 0;
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < 16; k++)
+            diff = std::max(diff, fabsf(mout[i].arr[k] - mold[i].arr[k]));
+    }
+    printf("%-44s old %.1f ns, new %.1f ns, max difference %g\n", "matrix multiply", oldNs, newNs, diff);
+
+    long long oldSum = 0, newSum = 0;
+    oldNs = BestNsPerOp(n, [&]() { for (int i = 0; i < n; i++) oldSum += old_math::f2(rows[i], cols[i]); });
+    newNs = BestNsPerOp(n, [&]() { for (int i = 0; i < n; i++) newSum += mat4x4f_column_major(rows[i], cols[i]); });
+    printf("%-44s old %.1f ns, new %.1f ns, checksums %lld %lld\n", "column-major index", oldNs, newNs, oldSum, newSum);
+}
+
+// vrserver's input interface, counting the component updates
+class CountingDriverInput : public vr::IVRDriverInput
+{
+public:
+    CountingDriverInput() : updates(0) {}
+
+    vr::EVRInputError CreateBooleanComponent(vr::PropertyContainerHandle_t, const char *, vr::VRInputComponentHandle_t *) override { return vr::VRInputError_None; }
+    vr::EVRInputError UpdateBooleanComponent(vr::VRInputComponentHandle_t, bool, double) override { updates++; return vr::VRInputError_None; }
+    vr::EVRInputError CreateScalarComponent(vr::PropertyContainerHandle_t, const char *, vr::VRInputComponentHandle_t *, vr::EVRScalarType, vr::EVRScalarUnits) override { return vr::VRInputError_None; }
+    vr::EVRInputError UpdateScalarComponent(vr::VRInputComponentHandle_t, float, double) override { updates++; return vr::VRInputError_None; }
+    vr::EVRInputError CreateHapticComponent(vr::PropertyContainerHandle_t, const char *, vr::VRInputComponentHandle_t *) override { return vr::VRInputError_None; }
+    vr::EVRInputError CreateSkeletonComponent(vr::PropertyContainerHandle_t, const char *, const char *, const char *, vr::EVRSkeletalTrackingLevel,
+                                              const vr::VRBoneTransform_t *, uint32_t, vr::VRInputComponentHandle_t *) override { return vr::VRInputError_None; }
+    vr::EVRInputError UpdateSkeletonComponent(vr::VRInputComponentHandle_t, vr::EVRSkeletalMotionRange, const vr::VRBoneTransform_t *, uint32_t) override { return vr::VRInputError_None; }
+
+    int updates;
+};
+
+// stands in for ohmd_device_geti(OHMD_CONTROL_COUNT), which the old loop called every frame
+static BENCHMARK_NOINLINE void StubGetControlCount(int *count) { *count = 10; }
+
+// Cost of one controller RunFrame dispatching the controls of a CV1 Touch controller to its
+// input components: DispatchInputs over the binding table built in Activate, as the driver
+// runs it, against the loop over all controls and three handle arrays it replaced. One analog
+// control moves every frame.
+static void BenchmarkInputDispatch()
+{
+    // trigger, squeeze, menu, stick x and y, stick press, two buttons with touch, two unmapped
+    const InputKind kinds[10] = { InputKind_Scalar, InputKind_Scalar, InputKind_Boolean, InputKind_Scalar, InputKind_Scalar,
+                                  InputKind_Boolean, InputKind_Boolean, InputKind_Boolean, InputKind_Boolean, InputKind_Boolean };
+    const bool mapped[10] = { true, true, true, true, true, true, true, true, false, false };
+    const bool touches[10] = { false, false, false, false, false, false, true, true, false, false };
+
+    const vr::VRInputComponentHandle_t invalid = vr::k_ulInvalidInputComponentHandle;
+    vr::VRInputComponentHandle_t buttons[64], analog[64], touch[64];
+    std::vector<InputBinding> inputs;
+    for (int i = 0; i < 64; i++)
+        buttons[i] = analog[i] = touch[i] = invalid;
+    for (int i = 0; i < 10; i++) {
+        if (mapped[i]) {
+            (kinds[i] == InputKind_Boolean ? buttons : analog)[i] = 100 + i;
+            inputs.push_back({ i, kinds[i], (vr::VRInputComponentHandle_t) (100 + i) });
+        }
+        if (touches[i]) {
+            touch[i] = 200 + i;
+            inputs.push_back({ i, InputKind_Touch, (vr::VRInputComponentHandle_t) (200 + i) });
+        }
+    }
+
+    const int frames = 1 << 20;
+    const int64_t frameNs = 11111111; // 90 Hz
+    ControlSample controls = ControlSample();
+    InputUpdateGate oldGate, newGate;
+    oldGate.Configure(0.002f, 1000000000ll);
+    newGate.Configure(0.002f, 1000000000ll);
+    CountingDriverInput oldInput, newInput;
+    vr::IVRDriverInput *oldDriverInput = &oldInput, *newDriverInput = &newInput;
+
+    double oldNs = BestNsPerOp(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            const float *state = controls.state;
+            controls.state[0] = (f % 100) * 0.01f;
+            int count;
+            StubGetControlCount(&count);
+            oldGate.BeginFrame(f * frameNs);
+            for (int i = 0; i < count; i++) {
+                if (buttons[i] != invalid) {
+                    if (oldGate.ShouldSendBoolean(i, state[i] != 0))
+                        oldDriverInput->UpdateBooleanComponent(buttons[i], state[i] != 0, 0);
+                } else if (analog[i] != invalid) {
+                    if (oldGate.ShouldSendScalar(i, state[i]))
+                        oldDriverInput->UpdateScalarComponent(analog[i], state[i], 0);
+                }
+                if (touch[i] != invalid) {
+                    if (oldGate.ShouldSendTouch(i, state[i] != 0))
+                        oldDriverInput->UpdateScalarComponent(touch[i], state[i] == 0 ? 0.0f : 1.0f, 0);
+                }
+            }
+        }
+    });
+
+    double newNs = BestNsPerOp(frames, [&]() {
+        int64_t lastControlsTime = 0;
+        for (int f = 0; f < frames; f++) {
+            int64_t now = f * frameNs;
+            controls.state[0] = (f % 100) * 0.01f;
+            controls.changed[0] = controls.time = now;
+            newGate.BeginFrame(now);
+            DispatchInputs(inputs, controls, lastControlsTime, now, newGate, newDriverInput);
+            lastControlsTime = controls.time;
+        }
+    });
+
+    printf("%-44s old %.1f ns, new %.1f ns, updates %d %d\n", "controller input dispatch per frame", oldNs, newNs, oldInput.updates, newInput.updates);
+}
+
+// Throughput of every DistortBatch kernel the CPU supports
+static void BenchmarkDistortion()
+{
+    ohmd_device *hmd = BenchmarkHmd();
+    if (!hmd)
+        return;
+    printf("distortion kernel used by the driver: %s\n", DistortBatchKernelName());
+    BenchmarkDistortBatch(DistortionModel(hmd).GetEyeParams(vr::Eye_Left));
+}
+
+// Throughput and round trip error of every UndistortBatch kernel the CPU supports
+static void BenchmarkUndistortion()
+{
+    ohmd_device *hmd = BenchmarkHmd();
+    if (!hmd)
+        return;
+    DistortionModel(hmd).BenchmarkUndistort();
+}
+
+// Throughput of the whole distortion path for landscape, portrait and canted panels
+static void BenchmarkPanelRotation()
+{
+    ohmd_device *hmd = BenchmarkHmd();
+    if (!hmd)
+        return;
+    BenchmarkPanelRotations(DistortionModel(hmd));
+}
+
+struct Benchmark
+{
+    const char *name;
+    void (*run)();
+};
+
+static const Benchmark kBenchmarks[] = {
+    { "seqlock", BenchmarkSeqLock },
+    { "pose_history", BenchmarkPoseHistory },
+    { "pose_filter", BenchmarkPoseFilter },
+    { "math", BenchmarkMath },
+    { "input_dispatch", BenchmarkInputDispatch },
+    { "distortion", BenchmarkDistortion },
+    { "undistortion", BenchmarkUndistortion },
+    { "panel_rotation", BenchmarkPanelRotation },
+};
+
+int main(int argc, char **argv)
+{
+    StdoutDriverLog log;
+    InitDriverLog(&log);
+
+    for (const Benchmark &benchmark : kBenchmarks) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++)
+            selected = selected || strcmp(argv[i], benchmark.name) == 0;
+        if (!selected)
+            continue;
+        printf("== %s\n", benchmark.name);
+        benchmark.run();
+    }
+
+    CleanupDriverLog();
+    return 0;
+}
@@ -4,11 +4,27 @@
 
 #include <openvr_driver.h>
 #include "driverlog.h"
+#include "device_state.h"
+#include "timing_stats.h"
+#include "pose_filter.h"
+#include "pose_update_gate.h"
+#include "input_update_gate.h"
+#include "input_dispatch.h"
+#include "publish_scheduler.h"
+#include "distortion.h"
+#include "panel_rotation.h"
+#include "hidden_area.h"
+#include "ohmd_math.h"
 
 #include <assert.h>
 
 #include <vector>
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <algorithm>
 #include <chrono>
 #include <cstring>
 #include <sstream>
@@ -71,8 +87,48 @@ void print_infoi(ohmd_device* hmd, const char* name, int len, ohmd_int_value val
 static const char * const k_pch_Sample_Section = "driver_openhmd";
 static const char * const k_pch_Sample_SecondsFromVsyncToPhotons_Float = "secondsFromVsyncToPhotons";
 static const char * const k_pch_Sample_DisplayFrequency_Float = "displayFrequency";
+static const char * const k_pch_Sample_TrackingThread_Bool = "trackingThread";
+static const char * const k_pch_Sample_TrackingRate_Int32 = "trackingRate";
+static const char * const k_pch_Sample_VelocityWindow_Float = "velocityWindow";
+static const char * const k_pch_Sample_LogTimingStats_Bool = "logTimingStats";
+static const char * const k_pch_Sample_HmdFilter_String = "hmdFilter";
+static const char * const k_pch_Sample_ControllerFilter_String = "controllerFilter";
+static const char * const k_pch_Sample_FilterExponentialCutoff_Float = "filterExponentialCutoff";
+static const char * const k_pch_Sample_FilterOneEuroMinCutoff_Float = "filterOneEuroMinCutoff";
+static const char * const k_pch_Sample_FilterOneEuroBeta_Float = "filterOneEuroBeta";
+static const char * const k_pch_Sample_FilterOneEuroDCutoff_Float = "filterOneEuroDCutoff";
+static const char * const k_pch_Sample_FilterKalmanProcessNoise_Float = "filterKalmanProcessNoise";
+static const char * const k_pch_Sample_FilterKalmanMeasurementNoise_Float = "filterKalmanMeasurementNoise";
+static const char * const k_pch_Sample_PoseEpsilonRotation_Float = "poseEpsilonRotation";
+static const char * const k_pch_Sample_PoseEpsilonPosition_Float = "poseEpsilonPosition";
+static const char * const k_pch_Sample_PoseKeepAlive_Float = "poseKeepAlive";
+static const char * const k_pch_Sample_InputEpsilonAnalog_Float = "inputEpsilonAnalog";
+static const char * const k_pch_Sample_InputKeepAlive_Float = "inputKeepAlive";
+static const char * const k_pch_Sample_HmdPublishRate_Int32 = "hmdPublishRate";
+static const char * const k_pch_Sample_ControllerPublishRate_Int32 = "controllerPublishRate";
+static const char * const k_pch_Sample_DistortionGridSize_Int32 = "distortionGridSize";
+static const char * const k_pch_Sample_DistortionCache_Bool = "distortionCache";
+static const char * const k_pch_Sample_DistortionGridTolerance_Float = "distortionGridTolerance";
+static const char * const k_pch_Sample_HiddenAreaTriangles_Int32 = "hiddenAreaTriangles";
+static const char * const k_pch_Sample_RenderPixelDensity_Float = "renderPixelDensity";
+static const char * const k_pch_Sample_RenderTargetMaxSize_Int32 = "renderTargetMaxSize";
 
 HmdQuaternion_t identityquat{ 1, 0, 0, 0};
+
+static void ConfigurePoseUpdateGate(PoseUpdateGate &gate)
+{
+    float angle = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_PoseEpsilonRotation_Float ) * M_PI / 180;
+    float position = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_PoseEpsilonPosition_Float );
+    float keepAlive = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_PoseKeepAlive_Float );
+    gate.Configure(angle, position, (int64_t) (keepAlive * 1e9));
+}
+
+static void ConfigureInputUpdateGate(InputUpdateGate &gate)
+{
+    float analog = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_InputEpsilonAnalog_Float );
+    float keepAlive = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_InputKeepAlive_Float );
+    gate.Configure(analog, (int64_t) (keepAlive * 1e9));
+}
 //-----------------------------------------------------------------------------
 // Purpose:
 //-----------------------------------------------------------------------------
@@ -157,22 +213,44 @@ EVRInitError CWatchdogDriver_OpenHMD::Init( vr::IVRDriverContext *pDriverContext
     CleanupDriverLog();
 }
 
-class COpenHMDDeviceDriverController : public vr::ITrackedDeviceServerDriver /*, public vr::IVRControllerComponent */ {
+class COpenHMDDeviceDriverController : public vr::ITrackedDeviceServerDriver, public PosePublisher /*, public vr::IVRControllerComponent */ {
 public:
     int index;
     ohmd_device* device;
     int device_idx;
     int device_flags;
-    DriverPose_t pose;
 
-    bool m_is_oculus;
+    bool m_is_oculus = false;
 
-    COpenHMDDeviceDriverController(int index, ohmd_device* _device, int _device_idx) :
-		index(index), device(_device), device_idx(_device_idx) {
+    COpenHMDDeviceDriverController(DeviceStateStore *store, int index, ohmd_device* _device, int _device_idx) :
+		index(index), device(_device), device_idx(_device_idx), m_store(store) {
         DriverLog("construct controller object %d (OpenHMD device %d)\n", index, device_idx);
         m_unObjectId = vr::k_unTrackedDeviceIndexInvalid;
-        pose = { 0 };
 
+        device_flags = 0;
+        ohmd_list_geti(ctx, device_idx, OHMD_DEVICE_FLAGS, &device_flags);
+
+        // Set an initial position down and to the side, which will be
+        // used if there's no positional tracking
+        float initial_pos[3] = { (device_flags & OHMD_DEVICE_FLAGS_LEFT_CONTROLLER) ? -0.25f : 0.25f, -0.5f, 0.15f };
+        m_slot = m_store->AddDevice(device,
+                                    (device_flags & OHMD_DEVICE_FLAGS_ROTATIONAL_TRACKING) != 0,
+                                    (device_flags & OHMD_DEVICE_FLAGS_POSITIONAL_TRACKING) != 0,
+                                    initial_pos);
+        if (m_slot < 0)
+            DriverLog("too many tracked devices, controller %d has no pose\n", index);
+
+        ConfigurePoseUpdateGate(m_poseGate);
+        ConfigureInputUpdateGate(m_inputGate);
+
+        // fixed for a device, so IngestControls doesn't query it on every read
+        m_controlCount = 0;
+        if (device != NULL)
+          ohmd_device_geti(device, OHMD_CONTROL_COUNT, &m_controlCount);
+        if (m_controlCount > ControlSample::kMaxControls)
+          m_controlCount = ControlSample::kMaxControls;
+        if (m_controlCount < 0)
+          m_controlCount = 0;
 
         if (strcmp(ohmd_list_gets(ctx, device_idx, OHMD_VENDOR), "Oculus VR, Inc.") == 0) {
             m_is_oculus = true;
@@ -194,8 +272,6 @@ public:
 
         const char *controllerModel = ohmd_list_gets(ctx, device_idx, OHMD_PRODUCT);
 
-	ohmd_list_geti(ctx, device_idx, OHMD_DEVICE_FLAGS, &device_flags);
-
         vr::VRProperties()->SetStringProperty( m_ulPropertyContainer, Prop_ModelNumber_String, controllerModel);
         //vr::VRProperties()->SetStringProperty( m_ulPropertyContainer, Prop_RenderModelName_String, controllerModel);
 	//vr::VRProperties()->SetStringProperty( m_ulPropertyContainer, Prop_ModelNumber_String, "1" );
@@ -229,24 +305,15 @@ public:
 	if (device_flags & OHMD_DEVICE_FLAGS_LEFT_CONTROLLER) {
            DriverLog("Left Controller\n");
            vr::VRProperties()->SetInt32Property( m_ulPropertyContainer, Prop_ControllerRoleHint_Int32, TrackedControllerRole_LeftHand);
-	   // Set an initial position down and to the left, which will be
-	   // used if there's no positional tracking
-	   pose.vecPosition[0] = -0.25;
-	   pose.vecPosition[1] = -0.5;
-	   pose.vecPosition[2] = 0.15;
 	} else {
            DriverLog("Right Controller\n");
            vr::VRProperties()->SetInt32Property( m_ulPropertyContainer, Prop_ControllerRoleHint_Int32, TrackedControllerRole_RightHand);
-	   pose.vecPosition[0] = 0.25;
-	   pose.vecPosition[1] = -0.5;
-	   pose.vecPosition[2] = 0.15;
 	}
 
 
-        int control_count;
-        ohmd_device_geti(device, OHMD_CONTROL_COUNT, &control_count);
-        if (control_count > 64)
-          control_count = 64;
+        // new component handles, send all of them with the next frame
+        m_inputGate.Reset();
+        m_inputs.clear();
 
         const char* controls_fn_str[] = { "generic", "trigger", "trigger_click", "squeeze", "menu", "home",
                 "analog-x", "analog-y", "anlog_press", "button-a", "button-b", "button-x", "button-y",
@@ -259,15 +326,11 @@ public:
         ohmd_device_geti(device, OHMD_CONTROLS_HINTS, controls_fn);
         ohmd_device_geti(device, OHMD_CONTROLS_TYPES, controls_types);
 
-        for(int i = 0; i < control_count; i++){
-          DriverLog("%s (%s)%s\n", controls_fn_str[controls_fn[i]], controls_type_str[controls_types[i]], i == control_count - 1 ? "" : ", ");
+        for(int i = 0; i < m_controlCount; i++){
+          DriverLog("%s (%s)%s\n", controls_fn_str[controls_fn[i]], controls_type_str[controls_types[i]], i == m_controlCount - 1 ? "" : ", ");
           const char *control_map = NULL, *touch_map = NULL;
           EVRScalarUnits analog_type = VRScalarUnits_NormalizedOneSided;
 
-          m_buttons[i] = k_ulInvalidInputComponentHandle;
-          m_analogControls[i] = k_ulInvalidInputComponentHandle;
-          m_touchControls[i] = k_ulInvalidInputComponentHandle;
-
           // TODO: inputs match steamapps/common/SteamVR/drivers/oculus/resources/input/touch_profile.json
           // but also support other controllers
           switch (controls_fn[i]) {
@@ -323,16 +386,27 @@ public:
           }
 
           /* We fall through here for generic buttons */
+          InputBinding binding;
+          binding.control = i;
+          binding.handle = k_ulInvalidInputComponentHandle;
           if (control_map != NULL) {
             if (controls_types[i] == OHMD_DIGITAL) {
-              vr::VRDriverInput()->CreateBooleanComponent( m_ulPropertyContainer, control_map, m_buttons + i);
+              binding.kind = InputKind_Boolean;
+              vr::VRDriverInput()->CreateBooleanComponent( m_ulPropertyContainer, control_map, &binding.handle);
             }
             else {
-              vr::VRDriverInput()->CreateScalarComponent( m_ulPropertyContainer, control_map, m_analogControls + i, VRScalarType_Absolute, analog_type);
+              binding.kind = InputKind_Scalar;
+              vr::VRDriverInput()->CreateScalarComponent( m_ulPropertyContainer, control_map, &binding.handle, VRScalarType_Absolute, analog_type);
             }
+            if (binding.handle != k_ulInvalidInputComponentHandle)
+              m_inputs.push_back(binding);
           }
 	  if (touch_map != NULL) {
-              vr::VRDriverInput()->CreateScalarComponent( m_ulPropertyContainer, touch_map, m_touchControls + i, VRScalarType_Absolute, analog_type);
+              binding.kind = InputKind_Touch;
+              binding.handle = k_ulInvalidInputComponentHandle;
+              vr::VRDriverInput()->CreateScalarComponent( m_ulPropertyContainer, touch_map, &binding.handle, VRScalarType_Absolute, analog_type);
+              if (binding.handle != k_ulInvalidInputComponentHandle)
+                m_inputs.push_back(binding);
           }
         }
 
@@ -371,35 +445,79 @@ public:
             pchResponseBuffer[0] = 0;
     }
 
+    int GetSlot() const { return m_slot; }
+
+    // Reads the controls and stamps every control whose value changed. Called by the pose
+    // producer right after ohmd_ctx_update, so the stamps are as fine as the tracking rate.
+    void IngestControls()
+    {
+        if (device == NULL)
+            return;
+
+        // OpenHMD fills as many values as the device has controls, which may be more than we use
+        float control_state[256] = { 0 };
+        ohmd_device_getf(device, OHMD_CONTROLS_STATE, control_state);
+
+        int64_t now = PoseClockNow();
+        for (int i = 0; i < m_controlCount; i++) {
+            if (m_controlsRead.time == 0 || control_state[i] != m_controlsRead.state[i])
+                m_controlsRead.changed[i] = now;
+            m_controlsRead.state[i] = control_state[i];
+        }
+        m_controlsRead.time = now;
+        m_controls.Store(m_controlsRead);
+    }
+
     DriverPose_t GetPose()
     {
+	if (m_slot < 0)
+		return MakeInvalidPose();
+	return MakePose(m_store->snapshot[m_slot].Load());
+    }
+
+    // Interpolated or briefly extrapolated pose at a PoseClockNow() time.
+    // Only for the pose producer, which owns the history.
+    DriverPose_t GetPoseAt(int64_t time)
+    {
+	if (m_slot < 0)
+		return MakeInvalidPose();
+	return MakePose(m_store->history[m_slot].PoseAt(time));
+    }
+
+    virtual int64_t NewestSampleTime()
+    {
+	if (m_slot < 0 || m_store->history[m_slot].Count() == 0)
+		return 0;
+	return m_store->history[m_slot].Get(0).time;
+    }
+
+    DriverPose_t MakeInvalidPose()
+    {
+	DriverPose_t pose = { 0 };
+	pose.poseIsValid = false;
+	pose.result = TrackingResult_Uninitialized;
+	pose.deviceIsConnected = true;
+	pose.qRotation = identityquat;
+	pose.qWorldFromDriverRotation = identityquat;
+	pose.qDriverFromHeadRotation = identityquat;
+	return pose;
+    }
+
+    DriverPose_t MakePose(const PoseSample &sample)
+    {
+	DriverPose_t pose = { 0 };
 	pose.poseIsValid = true;
 	pose.result = TrackingResult_Running_OK;
 	pose.deviceIsConnected = true;
 
-	if (device_flags & OHMD_DEVICE_FLAGS_ROTATIONAL_TRACKING) {
-		float quat[4];
-		ohmd_device_getf(device, OHMD_ROTATION_QUAT, quat);
-		pose.qRotation.x = quat[0];
-		pose.qRotation.y = quat[1];
-		pose.qRotation.z = quat[2];
-		pose.qRotation.w = quat[3];
-	}
+	// the sample is older than this call, let SteamVR predict from the time it was read
+	pose.poseTimeOffset = (sample.time - PoseClockNow()) * 1e-9;
+	pose.qRotation = quatf_to_hmd(quatf_load(sample.quat));
+	vec3f_to_pose(vec3f_load(sample.pos), pose.vecPosition);
+	vec3f_to_pose(vec3f_load(sample.vel), pose.vecVelocity);
+	vec3f_to_pose(vec3f_load(sample.angvel), pose.vecAngularVelocity);
 
-	if (device_flags & OHMD_DEVICE_FLAGS_POSITIONAL_TRACKING) {
-		float pos[3];
-		ohmd_device_getf(device, OHMD_POSITION_VECTOR, pos);
-		pose.vecPosition[0] = pos[0];
-		pose.vecPosition[1] = pos[1];
-		pose.vecPosition[2] = pos[2];
-	}
-
-	// DriverLog("get controller %d pose %f %f %f %f, %f %f %f\n", index, quat[0], quat[1], quat[2], quat[3], pos[0], pos[1], pos[2]);
-
-	for (int i = 0; i < 3; i++) {
-		pose.vecDriverFromHeadTranslation[i] = 0.0;
-		pose.vecWorldFromDriverTranslation[i] = 0.0;
-	}
+	// DriverLog("get controller %d pose %f %f %f %f, %f %f %f\n", index, sample.quat[0], sample.quat[1], sample.quat[2], sample.quat[3], sample.pos[0], sample.pos[1], sample.pos[2]);
 
 	if (m_is_oculus) {
 		const HmdQuaternion_t oculusOffsetQ  = { 0.966, 0.259, 0, 0};
@@ -417,29 +535,35 @@ public:
 	return pose;
     }
 
-    void RunFrame() {
-        vr::VRServerDriverHost()->TrackedDevicePoseUpdated(m_unObjectId, GetPose(), sizeof( DriverPose_t ) );
-
-        int control_count;
-        float control_state[256];
-
-        ohmd_device_geti(device, OHMD_CONTROL_COUNT, &control_count);
-        if (control_count > 64)
-          control_count = 64;
+    virtual void UpdatePose(int64_t time) {
+        if ( m_unObjectId != vr::k_unTrackedDeviceIndexInvalid )
+        {
+            DriverPose_t pose = GetPoseAt(time);
+            m_sampleAge.Add((int64_t) (-pose.poseTimeOffset * 1e9));
+            if (m_poseGate.ShouldSend(pose, PoseClockNow()))
+                vr::VRServerDriverHost()->TrackedDevicePoseUpdated(m_unObjectId, pose, sizeof( DriverPose_t ) );
+        }
+    }
 
-        ohmd_device_getf(device, OHMD_CONTROLS_STATE, control_state);
+    void ReportTimingStats() {
+        m_sampleAge.Report();
+        m_poseGate.Report(("controller " + std::to_string(index)).c_str());
+        m_inputGate.Report(("controller " + std::to_string(index)).c_str());
+    }
 
-        for (int i = 0; i < control_count; i++) {
-          if (m_buttons[i] != k_ulInvalidInputComponentHandle) {
-            vr::VRDriverInput()->UpdateBooleanComponent( m_buttons[i], control_state[i] != 0, 0 );
-          }
-          else if (m_analogControls[i] != k_ulInvalidInputComponentHandle)
-            vr::VRDriverInput()->UpdateScalarComponent( m_analogControls[i], control_state[i], 0 );
-	  /* If the control is not 0, mark it touched */
-          if (m_touchControls[i] != k_ulInvalidInputComponentHandle) {
-            vr::VRDriverInput()->UpdateScalarComponent( m_touchControls[i], control_state[i] == 0 ? 0.0 : 1.0, 0 );
-          }
-        }
+    void RunFrame() {
+        if (m_inputs.empty())
+          return;
+
+        const ControlSample controls = m_controls.Load();
+        if (controls.time == 0)
+          return;
+
+        // only what changed since the last sent value, and everything every inputKeepAlive
+        int64_t now = PoseClockNow();
+        m_inputGate.BeginFrame(now);
+        DispatchInputs(m_inputs, controls, m_lastControlsTime, now, m_inputGate, vr::VRDriverInput());
+        m_lastControlsTime = controls.time;
     }
 
     VRControllerState_t controllerstate;
@@ -471,21 +595,34 @@ public:
 private:
     std::string m_sSerialNumber = "Controller serial number " + std::to_string(index);
     std::string m_sModelNumber = "Controller model number " + std::to_string(index);
-    vr::TrackedDeviceIndex_t m_unObjectId;
+    // read by the tracking thread, written by vrserver in Activate/Deactivate
+    std::atomic<vr::TrackedDeviceIndex_t> m_unObjectId;
     vr::PropertyContainerHandle_t m_ulPropertyContainer;
 
-    /* Generic button controls */
-    vr::VRInputComponentHandle_t m_buttons[64]; /* Maximum components we support */
-    /* Analog controls */
-    vr::VRInputComponentHandle_t m_analogControls[64]; /* Maximum components we support */
-    /* Touch controls */
-    vr::VRInputComponentHandle_t m_touchControls[64]; /* Maximum components we support */
+    DeviceStateStore *m_store;
+    int m_slot;
+    TimingHistogram m_sampleAge { "controller " + std::to_string(index) + " sample age" };
+    PoseUpdateGate m_poseGate;
+    InputUpdateGate m_inputGate;
+
+    // written by the pose producer, read by RunFrame
+    ControlSnapshot m_controls;
+    // only for the pose producer
+    ControlSample m_controlsRead = ControlSample();
+    // OHMD_CONTROL_COUNT, at most ControlSample::kMaxControls
+    int m_controlCount;
+    // only for RunFrame, time of the controls it sent last
+    int64_t m_lastControlsTime = 0;
+
+    // every created component, built in Activate, so RunFrame only walks mapped controls
+    std::vector<InputBinding> m_inputs;
 };
 
-class COpenHMDDeviceDriver final : public vr::ITrackedDeviceServerDriver, public vr::IVRDisplayComponent
+class COpenHMDDeviceDriver final : public vr::ITrackedDeviceServerDriver, public vr::IVRDisplayComponent, public PosePublisher
 {
 public:
-    COpenHMDDeviceDriver(int hmddisplay_idx, int hmdtracker_idx)
+    COpenHMDDeviceDriver(DeviceStateStore *store, int hmddisplay_idx, int hmdtracker_idx)
+        : m_store(store)
     {
         hmd = ohmd_list_open_device(ctx, hmddisplay_idx);
         if (hmdtracker_idx != -1 && hmdtracker_idx != hmddisplay_idx)
@@ -518,6 +655,9 @@ public:
 
         m_unObjectId = vr::k_unTrackedDeviceIndexInvalid;
         m_ulPropertyContainer = vr::k_ulInvalidPropertyContainer;
+        const float initial_pos[3] = { 0, 0, 0 };
+        m_slot = m_store->AddDevice(hmdtracker ? hmdtracker : hmd, true, true, initial_pos);
+        ConfigurePoseUpdateGate(m_poseGate);
 
         DriverLog( "Using settings values\n" );
         ohmd_device_getf(hmd, OHMD_EYE_IPD, &m_flIPD);
@@ -556,6 +696,8 @@ public:
         ohmd_device_geti(hmd, OHMD_SCREEN_VERTICAL_RESOLUTION, &m_nRenderHeight );
         //m_nRenderWidth /= 2;
         //m_nRenderHeight /= 2;
+        UpdateProjections();
+        ScaleRenderTargetToLens(DistortionModel(hmd), m_projections->unrotation[0].rotation);
 
         m_flSecondsFromVsyncToPhotons = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_SecondsFromVsyncToPhotons_Float );
         //TODO: find actual frequency somehow (from openhmd?)
@@ -570,9 +712,17 @@ public:
                                                 DriverLog( "driver_openhmd: Display Frequency: %f\n", m_flDisplayFrequency );
         DriverLog( "driver_openhmd: IPD: %f\n", m_flIPD );
 
-        float distortion_coeffs[4];
-        ohmd_device_getf(hmd, OHMD_UNIVERSAL_DISTORTION_K, &(distortion_coeffs[0]));
+        m_nDistortionGridSize = vr::VRSettings()->GetInt32( k_pch_Sample_Section, k_pch_Sample_DistortionGridSize_Int32 );
+        m_bDistortionCache = vr::VRSettings()->GetBool( k_pch_Sample_Section, k_pch_Sample_DistortionCache_Bool );
+        m_flDistortionGridTolerance = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_DistortionGridTolerance_Float );
+        m_nHiddenAreaTriangles = vr::VRSettings()->GetInt32( k_pch_Sample_Section, k_pch_Sample_HiddenAreaTriangles_Int32 );
+        // the grid, if any, is built in Activate
+        m_distortion = std::make_shared<const DistortionModel>(hmd);
+        m_bDistortionBuildPending = false;
+        m_nextDistortionCheck = PoseClockNow();
+        const float *distortion_coeffs = m_distortion->GetDistortionK();
         DriverLog("driver_openhmd: Distortion values a=%f b=%f c=%f d=%f\n", distortion_coeffs[0], distortion_coeffs[1], distortion_coeffs[2], distortion_coeffs[3]);
+        DriverLog("driver_openhmd: Distortion kernel: %s\n", DistortBatchKernelName());
 
 	/* Sleep for 1 second while activating to let the display connect */
 	std::this_thread::sleep_for( std::chrono::seconds(1) );
@@ -600,6 +750,10 @@ public:
         // return a constant that's not 0 (invalid) or 1 (reserved for Oculus)
         vr::VRProperties()->SetUint64Property( m_ulPropertyContainer, Prop_CurrentUniverseId_Uint64, 2 );
 
+        if (m_nDistortionGridSize > 0 && !m_bDistortionBuildPending)
+            StartDistortionBuild();
+        PublishHiddenArea(*std::atomic_load(&m_distortion));
+
         return VRInitError_None;
     }
 
@@ -671,57 +825,6 @@ public:
         }
     }
 
-    // flatten 2D indices in a 4x4 matrix explicit so it's easy to see what's happening:
-    int f1(int i, int j)
-    {
-        if (i == 0 && j == 0) return 0;
-        if (i == 0 && j == 1) return 1;
-        if (i == 0 && j == 2) return 2;
-        if (i == 0 && j == 3) return 3;
-
-        if (i == 1 && j == 0) return 4;
-        if (i == 1 && j == 1) return 5;
-        if (i == 1 && j == 2) return 6;
-        if (i == 1 && j == 3) return 7;
-
-        if (i == 2 && j == 0) return 8;
-        if (i == 2 && j == 1) return 9;
-        if (i == 2 && j == 2) return 10;
-        if (i == 2 && j == 3) return 11;
-
-        if (i == 3 && j == 0) return 12;
-        if (i == 3 && j == 1) return 13;
-        if (i == 3 && j == 2) return 14;
-        if (i == 3 && j == 3) return 15;
-
-        return -1;
-    }
-
-    int f2(int i, int j)
-    {
-        if (i == 0 && j == 0) return 0;
-        if (i == 0 && j == 1) return 4;
-        if (i == 0 && j == 2) return 8;
-        if (i == 0 && j == 3) return 12;
-
-        if (i == 1 && j == 0) return 1;
-        if (i == 1 && j == 1) return 5;
-        if (i == 1 && j == 2) return 9;
-        if (i == 1 && j == 3) return 13;
-
-        if (i == 2 && j == 0) return 2;
-        if (i == 2 && j == 1) return 6;
-        if (i == 2 && j == 2) return 10;
-        if (i == 2 && j == 3) return 14;
-
-        if (i == 3 && j == 0) return 3;
-        if (i == 3 && j == 1) return 7;
-        if (i == 3 && j == 2) return 11;
-        if (i == 3 && j == 3) return 15;
-
-        return -1;
-    }
-
     void columnMatrixToAngles(float *yaw, float *pitch, float *roll, float colMatrix[4][4] ) {
         double sinPitch, cosPitch, sinRoll, cosRoll, sinYaw, cosYaw;
 
@@ -748,70 +851,47 @@ public:
         *roll  = atan2(sinRoll, cosRoll) * 180 / M_PI;
     } 
     
-    typedef union {
-        float m[4][4];
-        float arr[16];
-    } mat4x4f;
-
-    void omat4x4f_mult(const mat4x4f* l, const mat4x4f* r, mat4x4f *o) {
-        for(int i = 0; i < 4; i++){
-            float a0 = l->m[i][0], a1 = l->m[i][1], a2 = l->m[i][2], a3 = l->m[i][3];
-            o->m[i][0] = a0 * r->m[0][0] + a1 * r->m[1][0] + a2 * r->m[2][0] + a3 * r->m[3][0];
-            o->m[i][1] = a0 * r->m[0][1] + a1 * r->m[1][1] + a2 * r->m[2][1] + a3 * r->m[3][1];
-            o->m[i][2] = a0 * r->m[0][2] + a1 * r->m[1][2] + a2 * r->m[2][2] + a3 * r->m[3][2];
-            o->m[i][3] = a0 * r->m[0][3] + a1 * r->m[1][3] + a2 * r->m[2][3] + a3 * r->m[3][3];
-        }
-    }
-    
-    void createUnRotation(float angle, mat4x4f *m) {
+    // the rotation part of the UV unrotation, so projection and distortion agree; like it, aspect
+    // corrected for a viewport that is not square
+    void createUnRotation(const UVTransform &rotation, mat4x4f *m) {
         memset(m, 0, sizeof(*m));
-        m->m[0][0] = 1.0f;
-        m->m[1][1] = 1.0f;
+        m->m[0][0] = rotation.m[0][0]; m->m[0][1] = rotation.m[0][1];
+        m->m[1][0] = rotation.m[1][0]; m->m[1][1] = rotation.m[1][1];
         m->m[2][2] = 1.0f;
         m->m[3][3] = 1.0f;
-        
-        DriverLog("Unrotating for angle %f\n", angle);
-        
-        if (angle > -5 && angle < 5) {
-            return;
-        }
-        
-        else if (angle > 85 && angle < 95) {
-            m->m[0][0] = 0.0f; m->m[0][1] = -1.0f; m->m[1][0] = 1.0f; m->m[1][1] = 0.0f;
-            m->m[0][1] = 1.0f; m->m[1][0] = -1.0f;
-        }
-
-        else if (angle > -95 && angle < -85) {
-            m->m[0][0] = 0.0f; m->m[0][1] = -1.0f; m->m[1][0] = 1.0f; m->m[1][1] = 0.0f;
-        }
-        
-        else {
-            DriverLog("UNIMPLEMENTED ROTATION!!!\n");
-        }
     }
 
     void GetProjectionRaw( EVREye eEye, float *pfLeft, float *pfRight, float *pfTop, float *pfBottom )
     {
-        mat4x4f ohmdprojection;
+        std::shared_ptr<const EyeProjections> projections = std::atomic_load(&m_projections);
+        const float *tangents = projections->tangents[eEye == Eye_Left ? 0 : 1];
+        *pfLeft = tangents[0];
+        *pfRight = tangents[1];
+        *pfTop = tangents[2];
+        *pfBottom = tangents[3];
+    }
+
+    void GetOhmdProjection( EVREye eEye, mat4x4f *projection )
+    {
         if (eEye == Eye_Left) {
-            ohmd_device_getf(hmd, OHMD_LEFT_EYE_GL_PROJECTION_MATRIX, ohmdprojection.arr);
+            ohmd_device_getf(hmd, OHMD_LEFT_EYE_GL_PROJECTION_MATRIX, projection->arr);
         } else {
-            ohmd_device_getf(hmd, OHMD_RIGHT_EYE_GL_PROJECTION_MATRIX, ohmdprojection.arr);
+            ohmd_device_getf(hmd, OHMD_RIGHT_EYE_GL_PROJECTION_MATRIX, projection->arr);
         }
+    }
 
+    // Frustum tangents from an OpenHMD projection matrix with the panel rotation taken out, and
+    // the panel rotation itself, for an eye viewport of the given aspect.
+    void ComputeProjection( mat4x4f ohmdprojection, float aspect, float tangents[4], PanelUnrotation *pUnrotation )
+    {
         float yaw, pitch, roll;
-        float p[4][4];
-        memcpy(p, ohmdprojection.arr, 16 * sizeof(float));
-        columnMatrixToAngles(&yaw, &pitch, &roll, p);
+        columnMatrixToAngles(&yaw, &pitch, &roll, ohmdprojection.m);
         
-        if (eEye == Eye_Left) {
-            rotation_left = yaw;
-        } else {
-            rotation_right = yaw;
-        }
+        *pUnrotation = PanelUnrotationForAngle(yaw, aspect);
+        DriverLog("Unrotating for angle %f (panel rotation %s)\n", yaw, PanelRotationName(pUnrotation->rotation));
         
         mat4x4f unrotation;
-        createUnRotation(yaw, &unrotation);
+        createUnRotation(pUnrotation->transform, &unrotation);
  
         DriverLog("unrotation\n%f %f %f %f\n%f %f %f %f %f\n%f %f %f %f\n%f %f %f %f\n",
             unrotation.arr[0], unrotation.arr[1], unrotation.arr[2], unrotation.arr[3],
@@ -819,30 +899,30 @@ public:
             unrotation.arr[8], unrotation.arr[9], unrotation.arr[10], unrotation.arr[11],
             unrotation.arr[12], unrotation.arr[13], unrotation.arr[14], unrotation.arr[15]);
             
-        omat4x4f_mult(&ohmdprojection, &unrotation, &ohmdprojection);
+        mat4x4f_mult(ohmdprojection, unrotation, &ohmdprojection);
         
         // http://stackoverflow.com/questions/10830293/ddg#12926655
         // get projection matrix from openhmd, convert it into lrtb + near,far with SO formula
         // then divide by near plane distance to get the tangents of the angles from the center plane (tan = opposite side = these values divided by adjacent side = near plane distance)
         // but negate top and bottom. who knows why. there are 3 or so issues for it on github
 
-        // f2 switches row-major and column-major
-        float m00 = ohmdprojection.arr[f2(0,0)];
-        //float m03 = ohmdprojection[f2(0,3)];
-        //float m10 = ohmdprojection[f2(1,3)];
-        float m11 = ohmdprojection.arr[f2(1,1)];
-        //float m13 = ohmdprojection[f2(1,3)];
-        float m23 = ohmdprojection.arr[f2(2,3)];
-        float m22 = ohmdprojection.arr[f2(2,2)];
-        float m12 = ohmdprojection.arr[f2(1,2)];
-        float m02 = ohmdprojection.arr[f2(0,2)];
+        // OpenHMD fills arr column-major
+        float m00 = ohmdprojection.arr[mat4x4f_column_major(0, 0)];
+        //float m03 = ohmdprojection[mat4x4f_column_major(0, 3)];
+        //float m10 = ohmdprojection[mat4x4f_column_major(1, 3)];
+        float m11 = ohmdprojection.arr[mat4x4f_column_major(1, 1)];
+        //float m13 = ohmdprojection[mat4x4f_column_major(1, 3)];
+        float m23 = ohmdprojection.arr[mat4x4f_column_major(2, 3)];
+        float m22 = ohmdprojection.arr[mat4x4f_column_major(2, 2)];
+        float m12 = ohmdprojection.arr[mat4x4f_column_major(1, 2)];
+        float m02 = ohmdprojection.arr[mat4x4f_column_major(0, 2)];
 
         float near   = m23/(m22-1);
         float far    = m23/(m22+1);
-        *pfBottom = -   (m12-1)/m11;
-        *pfTop    = -   (m12+1)/m11;
-        *pfLeft   =     (m02-1)/m00;
-        *pfRight  =     (m02+1)/m00;
+        tangents[3] = -   (m12-1)/m11; // bottom
+        tangents[2] = -   (m12+1)/m11; // top
+        tangents[0] =     (m02-1)/m00; // left
+        tangents[1] =     (m02+1)/m00; // right
         
         DriverLog("m 00 %f, 11 %f, 22 %f, 12 %f, 02 %f\n", m00, m11, m23, m22, m12, m02);
 
@@ -853,134 +933,256 @@ public:
             ohmdprojection.arr[12], ohmdprojection.arr[13], ohmdprojection.arr[14], ohmdprojection.arr[15]
         );
         
-        DriverLog("projectionraw values lrtb, near far: %f %f %f %f | %f %f\n", *pfLeft, *pfRight, *pfTop, *pfBottom, near, far);
+        DriverLog("projectionraw values lrtb, near far: %f %f %f %f | %f %f\n", tangents[0], tangents[1], tangents[2], tangents[3], near, far);
         
         //DriverLog("angles %f %f %f\n", yaw, pitch, roll);
     }
 
-    DistortionCoordinates_t ComputeDistortion( EVREye eEye, float fU, float fV )
+    // Called once from the constructor and again when OpenHMD reports different projection
+    // matrices, so GetProjectionRaw doesn't query OpenHMD or log on every call.
+    void UpdateProjections()
     {
-        float angle = (eEye == Eye_Left ? rotation_left : rotation_right);
-        
-        //DriverLog("Eye %d before: %f %f\n", eEye, fU, fV);
-                
-        if (angle > -5 && angle < 5) {
-        } else if (angle > 85 && angle < 95) {
-            float tmp = fV;
-            fV = 1. - fU;
-            fU = tmp;
-        } else if (angle > -95 && angle < -85) {
-            float tmp = fV;
-            fV = fU;
-            fU = 1.f - tmp;
-        } else {
-            float x = 0 * fU + -1 * fV;
-            float y = -1 * fU + 0 * 0 * fV;
-            fU = x;
-            fV = y;
+        std::shared_ptr<EyeProjections> projections = std::make_shared<EyeProjections>();
+        projections->aspect = ViewportAspect(DistortionModel(hmd).GetEyeParams(Eye_Left));
+        for (int eye = 0; eye < 2; eye++) {
+            GetOhmdProjection((EVREye) eye, &projections->source[eye]);
+            ComputeProjection(projections->source[eye], projections->aspect, projections->tangents[eye], &projections->unrotation[eye]);
         }
-        
-        //DriverLog("Eye %d after: %f %f\n", eEye, fU, fV);
-        
-        int hmd_w;
-        int hmd_h;
-        ohmd_device_geti(hmd, OHMD_SCREEN_HORIZONTAL_RESOLUTION, &hmd_w);
-        ohmd_device_geti(hmd, OHMD_SCREEN_VERTICAL_RESOLUTION, &hmd_h);
-        float ipd;
-        ohmd_device_getf(hmd, OHMD_EYE_IPD, &ipd);
-        float viewport_scale[2];
-        float distortion_coeffs[4];
-        float aberr_scale[3];
-        float sep;
-        float left_lens_center[2];
-        float right_lens_center[2];
-        //viewport is half the screen
-        ohmd_device_getf(hmd, OHMD_SCREEN_HORIZONTAL_SIZE, &(viewport_scale[0]));
-        viewport_scale[0] /= 2.0f;
-        ohmd_device_getf(hmd, OHMD_SCREEN_VERTICAL_SIZE, &(viewport_scale[1]));
-        //distortion coefficients
-        ohmd_device_getf(hmd, OHMD_UNIVERSAL_DISTORTION_K, &(distortion_coeffs[0]));
-        ohmd_device_getf(hmd, OHMD_UNIVERSAL_ABERRATION_K, &(aberr_scale[0]));
-        //calculate lens centers (assuming the eye separation is the distance betweenteh lense centers)
-        ohmd_device_getf(hmd, OHMD_LENS_HORIZONTAL_SEPARATION, &sep);
-        ohmd_device_getf(hmd, OHMD_LENS_VERTICAL_POSITION, &(left_lens_center[1]));
-        ohmd_device_getf(hmd, OHMD_LENS_VERTICAL_POSITION, &(right_lens_center[1]));
-        left_lens_center[0] = viewport_scale[0] - sep/2.0f;
-        right_lens_center[0] = sep/2.0f;
-        //asume calibration was for lens view to which ever edge of screen is further away from lens center
-        float warp_scale = (left_lens_center[0] > right_lens_center[0]) ? left_lens_center[0] : right_lens_center[0];
-
-        float lens_center[2];
-        lens_center[0] = (eEye == Eye_Left ? left_lens_center[0] : right_lens_center[0]);
-        lens_center[1] = (eEye == Eye_Left ? left_lens_center[1] : right_lens_center[1]);
-
-        float r[2];
-        r[0] = fU * viewport_scale[0] - lens_center[0];
-        r[1] = fV * viewport_scale[1] - lens_center[1];
-
-        r[0] /= warp_scale;
-        r[1] /= warp_scale;
-
-        float r_mag = sqrt(r[0] * r[0] + r[1] * r[1]);
-
-
-        float r_displaced[2];
-        r_displaced[0] = r[0] * (distortion_coeffs[3] + distortion_coeffs[2] * r_mag + distortion_coeffs[1] * r_mag * r_mag + distortion_coeffs[0] * r_mag * r_mag * r_mag);
-
-        r_displaced[1] = r[1] * (distortion_coeffs[3] + distortion_coeffs[2] * r_mag + distortion_coeffs[1] * r_mag * r_mag + distortion_coeffs[0] * r_mag * r_mag * r_mag);
-
-        r_displaced[0] *= warp_scale;
-        r_displaced[1] *= warp_scale;
-
-        float tc_r[2];
-        tc_r[0] = (lens_center[0] + aberr_scale[0] * r_displaced[0]) / viewport_scale[0];
-        tc_r[1] = (lens_center[1] + aberr_scale[0] * r_displaced[1]) / viewport_scale[1];
-
-        float tc_g[2];
-        tc_g[0] = (lens_center[0] + aberr_scale[1] * r_displaced[0]) / viewport_scale[0];
-        tc_g[1] = (lens_center[1] + aberr_scale[1] * r_displaced[1]) / viewport_scale[1];
-
-        float tc_b[2];
-        tc_b[0] = (lens_center[0] + aberr_scale[2] * r_displaced[0]) / viewport_scale[0];
-        tc_b[1] = (lens_center[1] + aberr_scale[2] * r_displaced[1]) / viewport_scale[1];
-
-        //DriverLog("Distort %f %f -> %f %f; %f %f %f %f\n", fU, fV, tc_b[0], tc_b[1], distortion_coeffs[0], distortion_coeffs[1], distortion_coeffs[2], distortion_coeffs[3]);
+        std::atomic_store(&m_projections, std::shared_ptr<const EyeProjections>(projections));
+    }
+
+    // whether OpenHMD still reports the projection matrices and viewport aspect of m_projections
+    bool ProjectionsCurrent()
+    {
+        std::shared_ptr<const EyeProjections> projections = std::atomic_load(&m_projections);
+        if (ViewportAspect(DistortionModel(hmd).GetEyeParams(Eye_Left)) != projections->aspect)
+            return false;
+        for (int eye = 0; eye < 2; eye++) {
+            mat4x4f projection;
+            GetOhmdProjection((EVREye) eye, &projection);
+            if (memcmp(projection.arr, projections->source[eye].arr, sizeof(projection.arr)) != 0)
+                return false;
+        }
+        return true;
+    }
 
+    DistortionCoordinates_t ComputeDistortion( EVREye eEye, float fU, float fV )
+    {
         DistortionCoordinates_t coordinates;
-        coordinates.rfBlue[0] = tc_b[0];
-        coordinates.rfBlue[1] = tc_b[1];
-        coordinates.rfGreen[0] = tc_g[0];
-        coordinates.rfGreen[1] = tc_g[1];
-        coordinates.rfRed[0] = tc_r[0];
-        coordinates.rfRed[1] = tc_r[1];
+        ComputeDistortionBatch(eEye, &fU, &fV, 1, &coordinates);
         return coordinates;
     }
 
+    // ComputeDistortion for n UVs at once, the lens model is evaluated with SIMD
+    void ComputeDistortionBatch( EVREye eEye, const float *pU, const float *pV, int n, DistortionCoordinates_t *pOut )
+    {
+        const int kChunk = 256;
+        float u[kChunk], v[kChunk];
+        std::shared_ptr<const DistortionModel> model = GetDistortionModel();
+        std::shared_ptr<const EyeProjections> projections = std::atomic_load(&m_projections);
+        const PanelUnrotation &unrotation = projections->unrotation[eEye == Eye_Left ? 0 : 1];
+
+        for (int start = 0; start < n; start += kChunk) {
+            int count = n - start < kChunk ? n - start : kChunk;
+            unrotation.Apply(pU + start, pV + start, count, u, v);
+            model->DistortMany(eEye, u, v, count, pOut + start);
+        }
+    }
+
+    // Called from RunFrame. Checks about once a second whether OpenHMD reports different optical
+    // parameters, for example after an IPD change, and swaps in a new distortion model and new
+    // projections, each only if its own inputs changed.
+    void RunFrame()
+    {
+        if (m_bDistortionBuildPending) {
+            // publish a finished build without blocking
+            if (m_distortionBuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+                GetDistortionModel();
+            return;
+        }
+
+        int64_t now = PoseClockNow();
+        if (now < m_nextDistortionCheck)
+            return;
+        m_nextDistortionCheck = now + 1000000000ll;
+
+        if (!ProjectionsCurrent()) {
+            DriverLog("driver_openhmd: projection changed\n");
+            UpdateProjections();
+        }
+
+        std::shared_ptr<const DistortionModel> current = std::atomic_load(&m_distortion);
+        if (current->IsCurrent(hmd))
+            return;
+
+        DistortionModel changed(hmd);
+        DriverLog("driver_openhmd: optical parameters changed, IPD %f\n", changed.GetIPD());
+        StartDistortionBuild();
+        if (m_ulPropertyContainer != vr::k_ulInvalidPropertyContainer)
+            PublishHiddenArea(changed);
+
+        if (changed.GetIPD() != m_flIPD) {
+            m_flIPD = changed.GetIPD();
+            if (m_ulPropertyContainer != vr::k_ulInvalidPropertyContainer)
+                vr::VRProperties()->SetFloatProperty( m_ulPropertyContainer, Prop_UserIpdMeters_Float, m_flIPD );
+        }
+    }
+
+    // The distortion shrinks or magnifies the render target on the panel, by the lens model's
+    // derivative at the lens center. Scales the render target from the eye viewport on the panel
+    // so there are renderPixelDensity render target pixels per panel pixel there, and limits it
+    // to renderTargetMaxSize pixels on the longer side. The lens model works in the unrotated
+    // viewport, whose width is the panel height for portrait panels.
+    void ScaleRenderTargetToLens(const DistortionModel &model, PanelRotation rotation)
+    {
+        float density = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_RenderPixelDensity_Float );
+        int32_t max_size = vr::VRSettings()->GetInt32( k_pch_Sample_Section, k_pch_Sample_RenderTargetMaxSize_Int32 );
+        if (density <= 0)
+            return;
+
+        float jacobian[2][2];
+        model.CenterJacobian(Eye_Left, jacobian);
+        if (!(jacobian[0][0] > 0 && jacobian[1][1] > 0))
+            return;
+
+        bool portrait = rotation == PanelRotation_Plus90 || rotation == PanelRotation_Minus90;
+        int32_t eye_width = portrait ? m_nWindowHeight : m_nWindowWidth / 2;
+        int32_t eye_height = portrait ? m_nWindowWidth / 2 : m_nWindowHeight;
+
+        float width = eye_width * density / jacobian[0][0];
+        float height = eye_height * density / jacobian[1][1];
+        float longer = width > height ? width : height;
+        if (max_size > 0 && longer > max_size) {
+            width *= max_size / longer;
+            height *= max_size / longer;
+        }
+
+        m_nRenderWidth = (int32_t) (width + 0.5f);
+        m_nRenderHeight = (int32_t) (height + 0.5f);
+        DriverLog("driver_openhmd: lens magnification at the center %.3f x %.3f, eye viewport %d x %d -> render target %d x %d, %.2f x %.2f render target pixels per panel pixel\n",
+                  jacobian[0][0], jacobian[1][1], eye_width, eye_height, m_nRenderWidth, m_nRenderHeight,
+                  m_nRenderWidth * jacobian[0][0] / eye_width, m_nRenderHeight * jacobian[1][1] / eye_height);
+    }
+
+    // Masks the parts of the render targets the lens model never samples, see HiddenAreaMesh.
+    void PublishHiddenArea(const DistortionModel &model)
+    {
+        if (m_nHiddenAreaTriangles <= 0)
+            return;
+
+        vr::CVRHiddenAreaHelpers helpers(vr::VRPropertiesRaw());
+        for (int eye = 0; eye < 2; eye++) {
+            const DistortionBatchParams &params = model.GetEyeParams((EVREye) eye);
+            // A mesh that masks pixels the lens shows is built again with more, smaller
+            // triangles, and not published at all if that doesn't help either.
+            HiddenAreaMesh mesh(params, m_nHiddenAreaTriangles);
+            int masked = mesh.MaskedVisibleSamples();
+            for (int triangles = 2 * m_nHiddenAreaTriangles; masked > 0 && triangles <= 8 * m_nHiddenAreaTriangles; triangles *= 2) {
+                DriverLog("driver_openhmd: hidden area of eye %d with %d triangles masks visible pixels at %d of %d sample points, trying %d triangles\n",
+                          eye, mesh.TriangleCount(), masked, mesh.TriangleCount() * 4, triangles);
+                mesh = HiddenAreaMesh(params, triangles);
+                masked = mesh.MaskedVisibleSamples();
+            }
+
+            // SetHiddenArea takes a non-const pointer. An empty mesh clears one published before,
+            // for other optical parameters.
+            std::vector<HmdVector2_t> vertices;
+            if (masked == 0)
+                vertices = mesh.Vertices();
+            helpers.SetHiddenArea((EVREye) eye, k_eHiddenAreaMesh_Standard, vertices.data(), (uint32_t) vertices.size());
+            if (masked == 0)
+                DriverLog("driver_openhmd: hidden area of eye %d: %d triangles mask %.2f%% of the render target (lens model: %.2f%%)\n",
+                          eye, mesh.TriangleCount(), mesh.HiddenFraction() * 100, mesh.ExactHiddenFraction() * 100);
+            else
+                DriverLog("driver_openhmd: hidden area of eye %d still masks visible pixels, not publishing one\n", eye);
+        }
+    }
+
+    // Builds a new model with its grid on a background thread. Until it is published,
+    // ComputeDistortion waits for it instead of using the old model.
+    void StartDistortionBuild()
+    {
+        std::lock_guard<std::mutex> lock(m_distortionBuildMutex);
+        m_distortionBuild = std::async(std::launch::async, &COpenHMDDeviceDriver::CreateDistortionModel, this).share();
+        m_bDistortionBuildPending = true;
+    }
+
+    std::shared_ptr<const DistortionModel> GetDistortionModel()
+    {
+        if (m_bDistortionBuildPending) {
+            std::lock_guard<std::mutex> lock(m_distortionBuildMutex);
+            if (m_bDistortionBuildPending) {
+                std::atomic_store(&m_distortion, m_distortionBuild.get());
+                m_bDistortionBuildPending = false;
+            }
+        }
+        return std::atomic_load(&m_distortion);
+    }
+
+    std::shared_ptr<const DistortionModel> CreateDistortionModel()
+    {
+        std::shared_ptr<DistortionModel> model = std::make_shared<DistortionModel>(hmd);
+        if (m_nDistortionGridSize <= 0)
+            return model;
+
+        // the adaptive mesh is cheap to build and not cached
+        if (m_flDistortionGridTolerance > 0) {
+            model->BuildQuadtree(m_nDistortionGridSize, m_flDistortionGridTolerance);
+            return model;
+        }
+
+        std::string cache = m_bDistortionCache ? DistortionCachePath(m_sSerialNumber) : std::string();
+        uint64_t key = model->CacheKey(m_sSerialNumber);
+        if (!cache.empty() && model->LoadGrid(cache, key, m_nDistortionGridSize)) {
+            DriverLog("driver_openhmd: distortion grid loaded from %s\n", cache.c_str());
+        } else {
+            int threads = (int) std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+            model->BuildGrid(m_nDistortionGridSize, threads);
+            if (!cache.empty() && !model->SaveGrid(cache, key))
+                DriverLog("driver_openhmd: could not write distortion cache %s\n", cache.c_str());
+        }
+        return model;
+    }
+
+    int GetSlot() const { return m_slot; }
+
+    // the HMD is created first, so it always gets a slot
     DriverPose_t GetPose()
+    {
+        return MakePose(m_store->snapshot[m_slot].Load());
+    }
+
+    // Interpolated or briefly extrapolated pose at a PoseClockNow() time.
+    // Only for the pose producer, which owns the history.
+    DriverPose_t GetPoseAt(int64_t time)
+    {
+        return MakePose(m_store->history[m_slot].PoseAt(time));
+    }
+
+    virtual int64_t NewestSampleTime()
+    {
+        if (m_store->history[m_slot].Count() == 0)
+            return 0;
+        return m_store->history[m_slot].Get(0).time;
+    }
+
+    DriverPose_t MakePose(const PoseSample &sample)
     {
         DriverPose_t pose = { 0 };
         pose.poseIsValid = true;
         pose.result = TrackingResult_Running_OK;
         pose.deviceIsConnected = true;
 
-        ohmd_device* d = hmdtracker ? hmdtracker : hmd;
+        // the sample is older than this call, let SteamVR predict from the time it was read
+        pose.poseTimeOffset = (sample.time - PoseClockNow()) * 1e-9;
+        pose.qRotation = quatf_to_hmd(quatf_load(sample.quat));
+        vec3f_to_pose(vec3f_load(sample.pos), pose.vecPosition);
 
-        float quat[4];
-        ohmd_device_getf(d, OHMD_ROTATION_QUAT, quat);
-        pose.qRotation.x = quat[0];
-        pose.qRotation.y = quat[1];
-        pose.qRotation.z = quat[2];
-        pose.qRotation.w = quat[3];
+        // lets SteamVR extrapolate to photon time
+        vec3f_to_pose(vec3f_load(sample.vel), pose.vecVelocity);
+        vec3f_to_pose(vec3f_load(sample.angvel), pose.vecAngularVelocity);
 
-        float pos[3];
-        ohmd_device_getf(d, OHMD_POSITION_VECTOR, pos);
-        pose.vecPosition[0] = pos[0];
-        pose.vecPosition[1] = pos[1];
-        pose.vecPosition[2] = pos[2];
-
-        //printf("%f %f %f %f  %f %f %f\n", quat[0], quat[1], quat[2], quat[3], pos[0], pos[1], pos[2]);
-        //fflush(stdout);
-        //DriverLog("get hmd pose %f %f %f %f, %f %f %f\n", quat[0], quat[1], quat[2], quat[3], pos[0], pos[1], pos[2]);
+        //DriverLog("get hmd pose %f %f %f %f, %f %f %f\n", sample.quat[0], sample.quat[1], sample.quat[2], sample.quat[3], sample.pos[0], sample.pos[1], sample.pos[2]);
 
         pose.qWorldFromDriverRotation = identityquat;
         pose.qDriverFromHeadRotation = identityquat;
@@ -989,24 +1191,36 @@ public:
     }
 
 
-    void RunFrame()
+    // Called by the publish scheduler after ohmd_ctx_update, either from
+    // CServerDriver_OpenHMD::RunFrame or from the tracking thread. The RunFrame interval is
+    // unspecified and can be very irregular if some other driver blocks it for some periodic
+    // task, which the optional tracking thread avoids. The pose is taken from the history at
+    // the time the publish was due, which is the newest sample when publishing every update.
+    virtual void UpdatePose(int64_t time)
     {
-        // In a real driver, this should happen from some pose tracking thread.
-        // The RunFrame interval is unspecified and can be very irregular if some other
-        // driver blocks it for some periodic task.
         if ( m_unObjectId != vr::k_unTrackedDeviceIndexInvalid )
         {
-            vr::VRServerDriverHost()->TrackedDevicePoseUpdated( m_unObjectId, GetPose(), sizeof( DriverPose_t ) );
+            DriverPose_t pose = GetPoseAt(time);
+            m_sampleAge.Add((int64_t) (-pose.poseTimeOffset * 1e9));
+            if (m_poseGate.ShouldSend( pose, PoseClockNow() ))
+                vr::VRServerDriverHost()->TrackedDevicePoseUpdated( m_unObjectId, pose, sizeof( DriverPose_t ) );
         }
     }
 
+    void ReportTimingStats()
+    {
+        m_sampleAge.Report();
+        m_poseGate.Report("hmd");
+    }
+
     std::string GetSerialNumber() const { return m_sSerialNumber; }
 
 private:
     ohmd_device* hmd = NULL;
     ohmd_device* hmdtracker = NULL;
 
-    vr::TrackedDeviceIndex_t m_unObjectId;
+    // read by the tracking thread, written by vrserver in Activate/Deactivate
+    std::atomic<vr::TrackedDeviceIndex_t> m_unObjectId;
     vr::PropertyContainerHandle_t m_ulPropertyContainer;
 
     std::string m_sVendor;
@@ -1023,8 +1237,32 @@ private:
     float m_flDisplayFrequency;
     float m_flIPD;
     
-    float rotation_left = 0.0;
-    float rotation_right = 0.0;
+    // from UpdateProjections, replaced as a whole and read by GetProjectionRaw and
+    // ComputeDistortion on any thread
+    struct EyeProjections
+    {
+        float tangents[2][4]; // left, right, top, bottom per eye
+        mat4x4f source[2];    // the OpenHMD projection matrices they are computed from
+        float aspect;         // and the eye viewport aspect
+        PanelUnrotation unrotation[2];
+    };
+    std::shared_ptr<const EyeProjections> m_projections;
+
+    // replaced as a whole when a build finishes, read by ComputeDistortion on any thread
+    std::shared_ptr<const DistortionModel> m_distortion;
+    std::shared_future<std::shared_ptr<const DistortionModel>> m_distortionBuild;
+    std::atomic<bool> m_bDistortionBuildPending;
+    std::mutex m_distortionBuildMutex;
+    int64_t m_nextDistortionCheck;
+    int32_t m_nDistortionGridSize;
+    bool m_bDistortionCache;
+    float m_flDistortionGridTolerance;
+    int32_t m_nHiddenAreaTriangles;
+
+    DeviceStateStore *m_store;
+    int m_slot;
+    TimingHistogram m_sampleAge { "hmd sample age" };
+    PoseUpdateGate m_poseGate;
 };
 
 //-----------------------------------------------------------------------------
@@ -1035,6 +1273,15 @@ class CServerDriver_OpenHMD: public IServerTrackedDeviceProvider
 public:
     CServerDriver_OpenHMD()
         : m_OpenHMDDeviceDriver( NULL )
+        , m_OpenHMDDeviceDriverControllerL( NULL )
+        , m_OpenHMDDeviceDriverControllerR( NULL )
+        , m_pTrackingThread( NULL )
+        , m_bTrackingThreadRunning( false )
+        , m_nTrackingRate( 0 )
+        , m_bLogTimingStats( false )
+        , m_nextTimingReport( 0 )
+        , m_nHmdSlots( 0 )
+        , m_nControllerSlots( 0 )
     {
     }
     virtual ~CServerDriver_OpenHMD() {}
@@ -1048,9 +1295,36 @@ public:
     virtual void LeaveStandby()  {}
 
 private:
+    void UpdatePoses();
+    void TrackingThreadFunction();
+
     COpenHMDDeviceDriver *m_OpenHMDDeviceDriver;
     COpenHMDDeviceDriverController *m_OpenHMDDeviceDriverControllerL;
     COpenHMDDeviceDriverController *m_OpenHMDDeviceDriverControllerR;
+
+    // optional thread owning ohmd_ctx_update, see "trackingThread" in default.vrsettings
+    std::thread *m_pTrackingThread;
+    std::atomic<bool> m_bTrackingThreadRunning;
+    int m_nTrackingRate;
+
+    // "logTimingStats": periodically log the distribution of pose sample ages and other timings
+    bool m_bLogTimingStats;
+    int64_t m_nextTimingReport;
+
+    // poses of all devices, filled in one pass after every ohmd_ctx_update
+    DeviceStateStore m_deviceState;
+
+    // "hmdFilter" and "controllerFilter", each applied to the store slots of its device class
+    PoseFilterBank m_hmdFilter;
+    PoseFilterBank m_controllerFilter;
+    int m_hmdSlots[DeviceStateStore::kMaxDevices];
+    int m_nHmdSlots;
+    int m_controllerSlots[DeviceStateStore::kMaxDevices];
+    int m_nControllerSlots;
+    TimingHistogram m_filterCost { "pose filter cost per device" };
+
+    // "hmdPublishRate" and "controllerPublishRate", when each device sends its pose to SteamVR
+    PublishScheduler m_publishScheduler;
 };
 
 CServerDriver_OpenHMD g_serverDriverOpenHMD;
@@ -1111,13 +1385,18 @@ EVRInitError CServerDriver_OpenHMD::Init( vr::IVRDriverContext *pDriverContext )
 
     DriverLog("Using HMD Display %d, HMD Tracker %d, Left Controller %d, Right Controller %d\n", hmddisplay_idx, hmdtracker_idx, lcontroller_idx, rcontroller_idx);
 
-    m_OpenHMDDeviceDriver = new COpenHMDDeviceDriver(hmddisplay_idx, hmdtracker_idx);
+    m_deviceState.SetVelocityWindow( (int64_t) (vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_VelocityWindow_Float ) * 1e9) );
+
+    m_OpenHMDDeviceDriver = new COpenHMDDeviceDriver(&m_deviceState, hmddisplay_idx, hmdtracker_idx);
+    m_hmdSlots[m_nHmdSlots++] = m_OpenHMDDeviceDriver->GetSlot();
     vr::VRServerDriverHost()->TrackedDeviceAdded( m_OpenHMDDeviceDriver->GetSerialNumber().c_str(), vr::TrackedDeviceClass_HMD, m_OpenHMDDeviceDriver );
 
     if (lcontroller_idx >= 0) {
 	ohmd_device* lcontroller = ohmd_list_open_device(ctx, lcontroller_idx);
 	if (lcontroller)
-		m_OpenHMDDeviceDriverControllerL = new COpenHMDDeviceDriverController(0, lcontroller, lcontroller_idx);
+		m_OpenHMDDeviceDriverControllerL = new COpenHMDDeviceDriverController(&m_deviceState, 0, lcontroller, lcontroller_idx);
+	if (m_OpenHMDDeviceDriverControllerL && m_OpenHMDDeviceDriverControllerL->GetSlot() >= 0)
+		m_controllerSlots[m_nControllerSlots++] = m_OpenHMDDeviceDriverControllerL->GetSlot();
 	if (m_OpenHMDDeviceDriverControllerL)
 		vr::VRServerDriverHost()->TrackedDeviceAdded( m_OpenHMDDeviceDriverControllerL->GetSerialNumber().c_str(), vr::TrackedDeviceClass_Controller, m_OpenHMDDeviceDriverControllerL );
     }
@@ -1125,16 +1404,78 @@ EVRInitError CServerDriver_OpenHMD::Init( vr::IVRDriverContext *pDriverContext )
     if (rcontroller_idx >= 0) {
 	ohmd_device *rcontroller = ohmd_list_open_device(ctx, rcontroller_idx);
 	if (rcontroller)
-		m_OpenHMDDeviceDriverControllerR = new COpenHMDDeviceDriverController(1, rcontroller, rcontroller_idx);
+		m_OpenHMDDeviceDriverControllerR = new COpenHMDDeviceDriverController(&m_deviceState, 1, rcontroller, rcontroller_idx);
+	if (m_OpenHMDDeviceDriverControllerR && m_OpenHMDDeviceDriverControllerR->GetSlot() >= 0)
+		m_controllerSlots[m_nControllerSlots++] = m_OpenHMDDeviceDriverControllerR->GetSlot();
 	if (m_OpenHMDDeviceDriverControllerR)
 		vr::VRServerDriverHost()->TrackedDeviceAdded(  m_OpenHMDDeviceDriverControllerR->GetSerialNumber().c_str(), vr::TrackedDeviceClass_Controller, m_OpenHMDDeviceDriverControllerR );
     }
 
+    m_bLogTimingStats = vr::VRSettings()->GetBool( k_pch_Sample_Section, k_pch_Sample_LogTimingStats_Bool );
+    m_nextTimingReport = PoseClockNow();
+
+    {
+        PoseFilterParams params;
+        params.exponential_cutoff = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_FilterExponentialCutoff_Float );
+        params.oneeuro_min_cutoff = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_FilterOneEuroMinCutoff_Float );
+        params.oneeuro_beta = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_FilterOneEuroBeta_Float );
+        params.oneeuro_d_cutoff = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_FilterOneEuroDCutoff_Float );
+        params.kalman_process_noise = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_FilterKalmanProcessNoise_Float );
+        params.kalman_measurement_noise = vr::VRSettings()->GetFloat( k_pch_Sample_Section, k_pch_Sample_FilterKalmanMeasurementNoise_Float );
+
+        char chain[256] = { 0 };
+        vr::VRSettings()->GetString( k_pch_Sample_Section, k_pch_Sample_HmdFilter_String, chain, sizeof(chain) );
+        m_hmdFilter.Configure("hmd", chain, params);
+        chain[0] = 0;
+        vr::VRSettings()->GetString( k_pch_Sample_Section, k_pch_Sample_ControllerFilter_String, chain, sizeof(chain) );
+        m_controllerFilter.Configure("controller", chain, params);
+    }
+
+    {
+        // a rate of 0 publishes after every pose update
+        int hmdRate = vr::VRSettings()->GetInt32( k_pch_Sample_Section, k_pch_Sample_HmdPublishRate_Int32 );
+        int controllerRate = vr::VRSettings()->GetInt32( k_pch_Sample_Section, k_pch_Sample_ControllerPublishRate_Int32 );
+        int64_t hmdPeriod = hmdRate > 0 ? 1000000000ll / hmdRate : 0;
+        int64_t controllerPeriod = controllerRate > 0 ? 1000000000ll / controllerRate : 0;
+
+        m_publishScheduler.Add(m_OpenHMDDeviceDriver, hmdPeriod);
+        if (m_OpenHMDDeviceDriverControllerL)
+            m_publishScheduler.Add(m_OpenHMDDeviceDriverControllerL, controllerPeriod);
+        if (m_OpenHMDDeviceDriverControllerR)
+            m_publishScheduler.Add(m_OpenHMDDeviceDriverControllerR, controllerPeriod);
+        DriverLog("publishing the hmd at %d Hz and controllers at %d Hz (0: every update)\n", hmdRate, controllerRate);
+    }
+
+    if (vr::VRSettings()->GetBool( k_pch_Sample_Section, k_pch_Sample_TrackingThread_Bool )) {
+        m_nTrackingRate = vr::VRSettings()->GetInt32( k_pch_Sample_Section, k_pch_Sample_TrackingRate_Int32 );
+        if (m_nTrackingRate <= 0)
+            m_nTrackingRate = 1000;
+
+        m_publishScheduler.Start(1000000000ll / m_nTrackingRate, PoseClockNow());
+
+        DriverLog("starting tracking thread at %d Hz\n", m_nTrackingRate);
+        m_bTrackingThreadRunning = true;
+        m_pTrackingThread = new std::thread( &CServerDriver_OpenHMD::TrackingThreadFunction, this );
+    } else {
+        // RunFrame has no fixed interval, use a fine grained wheel
+        m_publishScheduler.Start(1000000, PoseClockNow());
+        DriverLog("no tracking thread, updating poses in RunFrame\n");
+    }
+
     return VRInitError_None;
 }
 
 void CServerDriver_OpenHMD::Cleanup()
 {
+    // the tracking thread uses the devices and ctx, stop it before they go away
+    m_bTrackingThreadRunning = false;
+    if ( m_pTrackingThread )
+    {
+        m_pTrackingThread->join();
+        delete m_pTrackingThread;
+        m_pTrackingThread = NULL;
+    }
+
     CleanupDriverLog();
     delete m_OpenHMDDeviceDriver;
     m_OpenHMDDeviceDriver = NULL;
@@ -1149,11 +1490,70 @@ void CServerDriver_OpenHMD::Cleanup()
 }
 
 
-void CServerDriver_OpenHMD::RunFrame()
+void CServerDriver_OpenHMD::UpdatePoses()
 {
     ohmd_ctx_update(ctx);
 
-    if ( m_OpenHMDDeviceDriver )
+    // read all devices first so the published poses come from the same update
+    m_deviceState.Ingest();
+    if (m_OpenHMDDeviceDriverControllerL)
+        m_OpenHMDDeviceDriverControllerL->IngestControls();
+    if (m_OpenHMDDeviceDriverControllerR)
+        m_OpenHMDDeviceDriverControllerR->IngestControls();
+
+    // one batched pass per device class
+    if ((!m_hmdFilter.Empty() || !m_controllerFilter.Empty()) && m_deviceState.Count() > 0) {
+        int64_t filterStart = PoseClockNow();
+        m_hmdFilter.Apply(m_deviceState, m_hmdSlots, m_nHmdSlots);
+        m_controllerFilter.Apply(m_deviceState, m_controllerSlots, m_nControllerSlots);
+        m_filterCost.Add((PoseClockNow() - filterStart) / m_deviceState.Count());
+    }
+
+    m_deviceState.Publish();
+
+    int64_t now = PoseClockNow();
+    m_publishScheduler.Run(now);
+
+    if (m_bLogTimingStats && now >= m_nextTimingReport) {
+        m_nextTimingReport = now + 10 * 1000000000ll;
+
+        if ( m_OpenHMDDeviceDriver )
+            m_OpenHMDDeviceDriver->ReportTimingStats();
+        if (m_OpenHMDDeviceDriverControllerL)
+            m_OpenHMDDeviceDriverControllerL->ReportTimingStats();
+        if (m_OpenHMDDeviceDriverControllerR)
+            m_OpenHMDDeviceDriverControllerR->ReportTimingStats();
+        m_filterCost.Report();
+    }
+}
+
+// Controller inputs are read here together with the poses and sent to SteamVR from RunFrame on
+// the vrserver thread, with the time they were read.
+void CServerDriver_OpenHMD::TrackingThreadFunction()
+{
+    const std::chrono::nanoseconds interval( 1000000000 / m_nTrackingRate );
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+    while ( m_bTrackingThreadRunning )
+    {
+        UpdatePoses();
+
+        next += interval;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        // after a stall don't try to catch up with a burst of updates
+        if (next < now)
+            next = now;
+        std::this_thread::sleep_until( next );
+    }
+    DriverLog("tracking thread exit\n");
+}
+
+void CServerDriver_OpenHMD::RunFrame()
+{
+    if ( !m_pTrackingThread )
+        UpdatePoses();
+
+    if (m_OpenHMDDeviceDriver)
         m_OpenHMDDeviceDriver->RunFrame();
 
     if (m_OpenHMDDeviceDriverControllerL)
@@ -0,0 +1,167 @@
+// Checks of the driver's building blocks that need no HMD. Not part of the driver, run
+//   driver_test [name...]
+// to run all tests or only the named ones. Exits with 1 if any of them failed.
+
+#include "pose_history.h"
+#include "publish_scheduler.h"
+
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+static int s_failures;
+
+#define CHECK(condition, ...)                                      \
+    do {                                                           \
+        if (!(condition)) {                                        \
+            printf("%s:%d: %s: ", __FILE__, __LINE__, #condition); \
+            printf(__VA_ARGS__);                                   \
+            printf("\n");                                          \
+            s_failures++;                                          \
+        }                                                          \
+    } while (0)
+
+// records the times it is asked to publish at, with a newest sample time set by the test
+class RecordingPublisher : public PosePublisher
+{
+public:
+    RecordingPublisher() : newest(0) {}
+
+    void UpdatePose(int64_t time) override { times.push_back(time); }
+    int64_t NewestSampleTime() override { return newest; }
+
+    int64_t newest;
+    std::vector<int64_t> times;
+};
+
+// Publishing on every update uses the time of the update, also when the updates are exactly one
+// tick apart and when they jitter around the tick.
+static void TestSchedulerEveryUpdate()
+{
+    const int64_t tick = 1000000;
+    const int64_t jitter[] = { 0, 300000, -200000, 0, 450000, -400000 };
+    for (int jittered = 0; jittered < 2; jittered++) {
+        PublishScheduler scheduler;
+        RecordingPublisher publisher;
+        scheduler.Add(&publisher, 0);
+        scheduler.Start(tick, 1000 * tick);
+
+        for (int i = 1; i <= 60; i++) {
+            int64_t now = (1000 + i) * tick + (jittered ? jitter[i % 6] : 0);
+            publisher.newest = now - 50000;
+            size_t before = publisher.times.size();
+            scheduler.Run(now);
+            CHECK(publisher.times.size() == before + 1, "update %d%s published %d times", i, jittered ? " (jittered)" : "",
+                  (int) (publisher.times.size() - before));
+            if (publisher.times.size() == before + 1)
+                CHECK(publisher.times.back() == now, "update %d%s published at now%+lld ns", i, jittered ? " (jittered)" : "",
+                      (long long) (publisher.times.back() - now));
+        }
+    }
+}
+
+// A periodic publish uses the time it was due at while that is within a tick of the update,
+// never a time before the newest sample and never a time after the update.
+static void TestSchedulerPeriodic()
+{
+    const int64_t tick = 1000000, period = 2 * tick;
+    PublishScheduler scheduler;
+    RecordingPublisher publisher;
+    scheduler.Add(&publisher, period);
+    scheduler.Start(tick, 1000 * tick);
+
+    int64_t last = 0;
+    for (int i = 1; i <= 60; i++) {
+        int64_t now = (1000 + i) * tick;
+        // the sample of every third update is read late, just before the publish
+        publisher.newest = i % 3 == 0 ? now - 10000 : now - 500000;
+        size_t before = publisher.times.size();
+        scheduler.Run(now);
+        if (publisher.times.size() == before)
+            continue;
+        int64_t at = publisher.times.back();
+        CHECK(at >= publisher.newest, "update %d published at %lld ns before the newest sample", i, (long long) (publisher.newest - at));
+        CHECK(at <= now && at >= now - tick, "update %d published at now%+lld ns", i, (long long) (at - now));
+        // the first publish after Start is due at once, then they follow the period
+        CHECK(publisher.times.size() <= 2 || now - last == period, "update %d published %lld ns after the last one", i, (long long) (now - last));
+        last = now;
+    }
+    CHECK(publisher.times.size() >= 30, "published %d times in 60 ticks", (int) publisher.times.size());
+}
+
+// samples its pose from a history like the device drivers do
+class HistoryPublisher : public PosePublisher
+{
+public:
+    void UpdatePose(int64_t time) override { published.push_back(history.PoseAt(time)); }
+    int64_t NewestSampleTime() override { return history.Count() ? history.Get(0).time : 0; }
+
+    PoseHistory history;
+    std::vector<PoseSample> published;
+};
+
+// Every tracking update publishes the sample it just ingested, for the HMD at its default rate of
+// 0 and for controllers at 500 Hz with 1 kHz updates, with exact and jittered update times.
+static void TestSchedulerPublishesNewestSample()
+{
+    const int64_t tick = 1000000;
+    const int64_t jitter[] = { 0, 300000, -200000, 0, 450000, -400000 };
+    for (int jittered = 0; jittered < 2; jittered++) {
+        PublishScheduler scheduler;
+        HistoryPublisher hmd, controller;
+        scheduler.Add(&hmd, 0);
+        scheduler.Add(&controller, 2 * tick);
+        scheduler.Start(tick, 1000 * tick);
+
+        for (int i = 1; i <= 60; i++) {
+            int64_t now = (1000 + i) * tick + (jittered ? jitter[i % 6] : 0);
+            // ingested just before the publish, without velocity so every pose is its sample
+            PoseSample sample = PoseSample();
+            sample.quat[3] = 1;
+            sample.pos[0] = (float) i;
+            sample.time = now - 30000;
+            hmd.history.Push(sample);
+            controller.history.Push(sample);
+
+            size_t hmdBefore = hmd.published.size(), controllerBefore = controller.published.size();
+            scheduler.Run(now);
+            CHECK(hmd.published.size() == hmdBefore + 1, "update %d%s: hmd published %d times", i, jittered ? " (jittered)" : "",
+                  (int) (hmd.published.size() - hmdBefore));
+            if (hmd.published.size() > hmdBefore)
+                CHECK(hmd.published.back().pos[0] == i, "update %d%s: hmd published sample %g", i, jittered ? " (jittered)" : "",
+                      hmd.published.back().pos[0]);
+            if (controller.published.size() > controllerBefore)
+                CHECK(controller.published.back().pos[0] == i, "update %d%s: controller published sample %g", i, jittered ? " (jittered)" : "",
+                      controller.published.back().pos[0]);
+        }
+        CHECK(controller.published.size() >= 25, "controller%s published %d times in 60 updates", jittered ? " (jittered)" : "",
+              (int) controller.published.size());
+    }
+}
+
+struct Test
+{
+    const char *name;
+    void (*run)();
+};
+
+static const Test kTests[] = {
+    { "scheduler_every_update", TestSchedulerEveryUpdate },
+    { "scheduler_periodic", TestSchedulerPeriodic },
+    { "scheduler_newest_sample", TestSchedulerPublishesNewestSample },
+};
+
+int main(int argc, char **argv)
+{
+    for (const Test &test : kTests) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++)
+            selected = selected || strcmp(argv[i], test.name) == 0;
+        if (!selected)
+            continue;
+        int failures = s_failures;
+        test.run();
+        printf("%s %s\n", s_failures == failures ? "ok    " : "FAILED", test.name);
+    }
+    return s_failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,256 @@
+#ifndef HIDDEN_AREA_H
+#define HIDDEN_AREA_H
+
+#pragma once
+
+#include "distortion_batch.h"
+
+#include <vector>
+#include <math.h>
+
+// Hidden area mesh of one eye: triangles over the parts of the render target the lens model
+// never samples, so the compositor and applications can skip shading them.
+//
+// The model moves every point of the panel along the ray from the lens center, so in render
+// target space the visible area is star shaped around the lens center. Along a ray its edge
+// is the image of where the ray leaves the panel, scaled by the largest chromatic aberration
+// factor. Rays are cast from the lens center to many points on the border of the render target,
+// and thinned out to the triangle budget where the visible area doesn't reach the border. Each
+// pair of neighboring rays gives up to two triangles between the visible edge and the border.
+// The inner vertices are moved outwards until the straight triangle edges clear the curved
+// visible edge, so no visible pixel is ever masked.
+class HiddenAreaMesh
+{
+public:
+    // at most max_triangles triangles, as a triangle list in render target UVs
+    HiddenAreaMesh(const DistortionBatchParams &p, int max_triangles) : m_p(p)
+    {
+        m_aberration = p.aberration[0];
+        for (int c = 1; c < 3; c++)
+            m_aberration = p.aberration[c] > m_aberration ? p.aberration[c] : m_aberration;
+
+        std::vector<Ray> rays = SelectRays(BorderRays(kDenseRays), max_triangles / 2);
+        int count = (int) rays.size();
+
+        // how far the inner vertices have to move out for the sectors on both sides of them
+        std::vector<float> sector_scale(count), scale(count);
+        for (int i = 0; i < count; i++)
+            sector_scale[i] = SectorScale(rays[i], rays[(i + 1) % count]);
+        for (int i = 0; i < count; i++)
+            scale[i] = fmaxf(sector_scale[i], sector_scale[(i + count - 1) % count]);
+
+        for (int i = 0; i < count; i++) {
+            const Ray &a = rays[i], &b = rays[(i + 1) % count];
+            float ta = fminf(a.visible * scale[i], 1.0f), tb = fminf(b.visible * scale[(i + 1) % count], 1.0f);
+            if (!a.joined || !Clears(a, b, ta, tb))
+                continue;
+            if (ta < 1)
+                AddTriangle(Point(a, ta), Point(a, 1), Point(b, 1));
+            if (tb < 1)
+                AddTriangle(Point(b, 1), Point(b, tb), Point(a, ta));
+        }
+    }
+
+    const std::vector<vr::HmdVector2_t> &Vertices() const { return m_vertices; }
+    int TriangleCount() const { return (int) m_vertices.size() / 3; }
+
+    // fraction of the render target the triangles cover
+    float HiddenFraction() const
+    {
+        double area = 0;
+        for (size_t i = 0; i + 2 < m_vertices.size(); i += 3) {
+            const vr::HmdVector2_t &a = m_vertices[i], &b = m_vertices[i + 1], &c = m_vertices[i + 2];
+            area += fabs((b.v[0] - a.v[0]) * (c.v[1] - a.v[1]) - (c.v[0] - a.v[0]) * (b.v[1] - a.v[1])) / 2;
+        }
+        return (float) area;
+    }
+
+    // Number of points inside the triangles, four per triangle, that some color channel still
+    // samples: UndistortBatch maps them back onto the panel. 0 unless the mesh masks visible pixels.
+    int MaskedVisibleSamples() const
+    {
+        std::vector<float> u, v;
+        for (size_t i = 0; i + 2 < m_vertices.size(); i += 3) {
+            const vr::HmdVector2_t *t = &m_vertices[i];
+            float cu = (t[0].v[0] + t[1].v[0] + t[2].v[0]) / 3, cv = (t[0].v[1] + t[1].v[1] + t[2].v[1]) / 3;
+            u.push_back(cu);
+            v.push_back(cv);
+            // halfway to each vertex
+            for (int k = 0; k < 3; k++) {
+                u.push_back((cu + t[k].v[0]) / 2);
+                v.push_back((cv + t[k].v[1]) / 2);
+            }
+        }
+
+        int n = (int) u.size(), masked = 0;
+        std::vector<float> panel_u(n), panel_v(n);
+        std::vector<bool> visible(n, false);
+        for (int c = 0; c < 3; c++) {
+            UndistortBatch(m_p, c, u.data(), v.data(), n, panel_u.data(), panel_v.data());
+            for (int i = 0; i < n; i++) {
+                const float margin = 1e-4f; // the error of the inverse
+                visible[i] = visible[i] || (panel_u[i] > margin && panel_u[i] < 1 - margin && panel_v[i] > margin && panel_v[i] < 1 - margin);
+            }
+        }
+        for (int i = 0; i < n; i++)
+            masked += visible[i];
+        return masked;
+    }
+
+    // fraction of the render target the lens model never samples, from a dense set of rays
+    float ExactHiddenFraction() const
+    {
+        std::vector<Ray> rays = BorderRays(4096);
+        double area = 0;
+        for (size_t i = 0; i < rays.size(); i++) {
+            const Ray &a = rays[i], &b = rays[(i + 1) % rays.size()];
+            float ta = fminf(a.visible, 1.0f), tb = fminf(b.visible, 1.0f);
+            // triangle between the lens center and the border minus the visible part of it
+            double cross = fabs(a.border[0] * b.border[1] - a.border[1] * b.border[0]) / 2;
+            area += cross * (1 - ta * tb);
+        }
+        return (float) (area / (m_p.viewport_scale[0] * m_p.viewport_scale[1]));
+    }
+
+private:
+    static const int kDenseRays = 1024;
+
+    // from the lens center to a point on the border of the render target, in meters on the
+    // panel, and the fraction of it that is visible
+    struct Ray
+    {
+        float border[2];
+        float visible;
+        bool corner;
+        bool joined; // the border up to the next ray is hidden, see SelectRays
+    };
+
+    Ray MakeRay(float x, float y) const
+    {
+        Ray ray;
+        ray.border[0] = x - m_p.lens_center[0];
+        ray.border[1] = y - m_p.lens_center[1];
+        float length = sqrtf(ray.border[0] * ray.border[0] + ray.border[1] * ray.border[1]);
+        // the panel and the render target have the same border, so this is also where the
+        // ray leaves the panel, and the visible edge is the image of that point
+        float s = length / m_p.warp_scale;
+        float f = m_p.k[3] + s * (m_p.k[2] + s * (m_p.k[1] + s * m_p.k[0]));
+        ray.visible = m_aberration * f;
+        ray.corner = false;
+        ray.joined = true;
+        return ray;
+    }
+
+    // count points on the border, spread by edge length, starting at each corner, in order
+    std::vector<Ray> BorderRays(int count) const
+    {
+        const float w = m_p.viewport_scale[0], h = m_p.viewport_scale[1];
+        const float corners[5][2] = { { 0, 0 }, { w, 0 }, { w, h }, { 0, h }, { 0, 0 } };
+        std::vector<Ray> rays;
+        for (int edge = 0; edge < 4; edge++) {
+            const float *from = corners[edge], *to = corners[edge + 1];
+            float length = fabsf(to[0] - from[0]) + fabsf(to[1] - from[1]);
+            int n = (int) (count * length / (2 * (w + h)));
+            n = n < 1 ? 1 : n;
+            for (int i = 0; i < n; i++) {
+                float t = (float) i / n;
+                rays.push_back(MakeRay(from[0] + (to[0] - from[0]) * t, from[1] + (to[1] - from[1]) * t));
+                rays.back().corner = i == 0;
+            }
+        }
+        return rays;
+    }
+
+    // At most count of the dense rays that border a hidden part of the border, and always the
+    // first and last one of each run of them and the corners, so the outer triangle edges
+    // follow the border.
+    std::vector<Ray> SelectRays(const std::vector<Ray> &dense, int count) const
+    {
+        int n = (int) dense.size();
+        std::vector<bool> candidate(n);
+        for (int i = 0; i < n; i++)
+            candidate[i] = dense[i].visible < 1 || dense[(i + n - 1) % n].visible < 1 || dense[(i + 1) % n].visible < 1;
+
+        // start outside of all runs, so none of them wraps around
+        int start = 0;
+        while (start < n && candidate[start])
+            start++;
+        start = start == n ? 0 : start;
+
+        std::vector<Ray> selected;
+        for (int stride = 1; ; stride *= 2) {
+            selected.clear();
+            for (int k = 0; k < n; k++) {
+                int i = (start + k) % n;
+                if (!candidate[i])
+                    continue;
+                bool first = !candidate[(i + n - 1) % n], last = !candidate[(i + 1) % n];
+                if (first || last || dense[i].corner || k % stride == 0) {
+                    selected.push_back(dense[i]);
+                    selected.back().joined = !last;
+                }
+            }
+            if ((int) selected.size() <= count || stride >= n)
+                return selected;
+        }
+    }
+
+    // A ray between a and b hits the triangle edge between the points at ta and tb of them at
+    // 1 / ((1 - l) / ta + l / tb) of its length, where l is how far the ray is from a to b
+    // along the border.
+    static float ChordFraction(float ta, float tb, float l) { return 1 / ((1 - l) / ta + l / tb); }
+
+    static const int kSectorSamples = 16;
+
+    Ray SectorRay(const Ray &a, const Ray &b, float l) const
+    {
+        return MakeRay(m_p.lens_center[0] + a.border[0] + (b.border[0] - a.border[0]) * l,
+                       m_p.lens_center[1] + a.border[1] + (b.border[1] - a.border[1]) * l);
+    }
+
+    // factor for both inner vertices so the edge between them is outside the visible area
+    float SectorScale(const Ray &a, const Ray &b) const
+    {
+        float scale = 1;
+        for (int i = 1; i < kSectorSamples; i++) {
+            float l = (float) i / kSectorSamples;
+            scale = fmaxf(scale, SectorRay(a, b, l).visible / ChordFraction(a.visible, b.visible, l));
+        }
+        // margin for the visible edge between the samples
+        return scale * 1.001f;
+    }
+
+    // whether the edge between the points at ta and tb is outside the visible area
+    bool Clears(const Ray &a, const Ray &b, float ta, float tb) const
+    {
+        if (ta < a.visible || tb < b.visible)
+            return false;
+        for (int i = 1; i < kSectorSamples; i++) {
+            float l = (float) i / kSectorSamples;
+            if (ChordFraction(ta, tb, l) < SectorRay(a, b, l).visible)
+                return false;
+        }
+        return true;
+    }
+
+    vr::HmdVector2_t Point(const Ray &ray, float t) const
+    {
+        vr::HmdVector2_t uv;
+        uv.v[0] = (m_p.lens_center[0] + ray.border[0] * t) / m_p.viewport_scale[0];
+        uv.v[1] = (m_p.lens_center[1] + ray.border[1] * t) / m_p.viewport_scale[1];
+        return uv;
+    }
+
+    void AddTriangle(const vr::HmdVector2_t &a, const vr::HmdVector2_t &b, const vr::HmdVector2_t &c)
+    {
+        m_vertices.push_back(a);
+        m_vertices.push_back(b);
+        m_vertices.push_back(c);
+    }
+
+    DistortionBatchParams m_p;
+    float m_aberration;
+    std::vector<vr::HmdVector2_t> m_vertices;
+};
+
+#endif // HIDDEN_AREA_H
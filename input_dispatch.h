@@ -0,0 +1,57 @@
+#ifndef INPUT_DISPATCH_H
+#define INPUT_DISPATCH_H
+
+#pragma once
+
+#include "input_update_gate.h"
+#include "pose_snapshot.h"
+
+#include <openvr_driver.h>
+
+#include <vector>
+#include <stdint.h>
+
+enum InputKind
+{
+    InputKind_Boolean, // digital control
+    InputKind_Scalar,  // analog control
+    InputKind_Touch,   // touched while the control is not 0
+};
+
+// an input component and the OpenHMD control it follows
+struct InputBinding
+{
+    int control;
+    InputKind kind;
+    vr::VRInputComponentHandle_t handle;
+};
+
+// Sends the controls of one read to the input components bound to them, only what gate lets
+// through. A change since last_controls_time, the read sent before, is sent with the time it
+// was first read, anything else is as old as this read. Call gate.BeginFrame(now) first.
+inline void DispatchInputs(const std::vector<InputBinding> &inputs, const ControlSample &controls, int64_t last_controls_time,
+                           int64_t now, InputUpdateGate &gate, vr::IVRDriverInput *driver_input)
+{
+    for (const InputBinding &input : inputs) {
+        float value = controls.state[input.control];
+        int64_t changed = controls.changed[input.control];
+        double offset = ((changed > last_controls_time ? changed : controls.time) - now) * 1e-9;
+        switch (input.kind) {
+        case InputKind_Boolean:
+            if (gate.ShouldSendBoolean(input.control, value != 0))
+                driver_input->UpdateBooleanComponent(input.handle, value != 0, offset);
+            break;
+        case InputKind_Scalar:
+            if (gate.ShouldSendScalar(input.control, value))
+                driver_input->UpdateScalarComponent(input.handle, value, offset);
+            break;
+        case InputKind_Touch:
+            /* If the control is not 0, mark it touched */
+            if (gate.ShouldSendTouch(input.control, value != 0))
+                driver_input->UpdateScalarComponent(input.handle, value == 0 ? 0.0f : 1.0f, offset);
+            break;
+        }
+    }
+}
+
+#endif // INPUT_DISPATCH_H
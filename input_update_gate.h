@@ -0,0 +1,128 @@
+#ifndef INPUT_UPDATE_GATE_H
+#define INPUT_UPDATE_GATE_H
+
+#pragma once
+
+#include "driverlog.h"
+
+#include <atomic>
+#include <math.h>
+#include <stdint.h>
+
+// Decides which input components of a controller are worth sending to vrserver with
+// UpdateBooleanComponent and UpdateScalarComponent. Buttons and touches are sent when they flip,
+// analog controls when they moved by more than an epsilon since the last sent value or reached
+// their rest or end position, and every component at least every keep-alive interval.
+// Only used by the thread that reads the controls; the counters may be reported from another.
+class InputUpdateGate
+{
+public:
+    static const int kMaxControls = 64;
+
+    InputUpdateGate() : m_analogEpsilon(0), m_keepAliveNs(0), m_lastRefresh(0), m_refresh(true), m_frameSent(0), m_frameSkipped(0), m_sent(0), m_skipped(0)
+    {
+        Reset();
+    }
+
+    // analog_epsilon in the units of the control, a keep_alive_ns of 0 sends every update
+    void Configure(float analog_epsilon, int64_t keep_alive_ns)
+    {
+        m_analogEpsilon = analog_epsilon;
+        m_keepAliveNs = keep_alive_ns;
+        Reset();
+    }
+
+    // forget the sent values, so everything is sent with the next frame
+    void Reset()
+    {
+        for (int i = 0; i < kMaxControls; i++) {
+            m_last[i] = 0;
+            m_hasLast[i] = m_hasLastTouch[i] = m_lastTouch[i] = false;
+        }
+    }
+
+    // once per frame, before the ShouldSend calls
+    void BeginFrame(int64_t now)
+    {
+        // the counters of the last frame, one atomic add each instead of one per component
+        if (m_frameSent)
+            m_sent.fetch_add(m_frameSent, std::memory_order_relaxed);
+        if (m_frameSkipped)
+            m_skipped.fetch_add(m_frameSkipped, std::memory_order_relaxed);
+        m_frameSent = m_frameSkipped = 0;
+
+        m_refresh = now - m_lastRefresh >= m_keepAliveNs;
+        if (m_refresh)
+            m_lastRefresh = now;
+    }
+
+    bool ShouldSendBoolean(int control, bool value)
+    {
+        bool send = m_refresh || !m_hasLast[control] || (m_last[control] != 0) != value;
+        if (!Count(send))
+            return false;
+        Remember(control, value ? 1.f : 0.f);
+        return true;
+    }
+
+    bool ShouldSendScalar(int control, float value)
+    {
+        float last = m_last[control];
+        bool send = m_refresh || !m_hasLast[control] || fabsf(value - last) > m_analogEpsilon ||
+                    (value != last && (value == 0 || fabsf(value) == 1)); // don't stop short of rest or full travel
+        if (!Count(send))
+            return false;
+        Remember(control, value);
+        return true;
+    }
+
+    bool ShouldSendTouch(int control, bool touched)
+    {
+        bool send = m_refresh || !m_hasLastTouch[control] || m_lastTouch[control] != touched;
+        if (!Count(send))
+            return false;
+        m_hasLastTouch[control] = true;
+        m_lastTouch[control] = touched;
+        return true;
+    }
+
+    // logs the counters since the last report and starts over
+    void Report(const char *name)
+    {
+        uint64_t sent = m_sent.exchange(0, std::memory_order_relaxed);
+        uint64_t skipped = m_skipped.exchange(0, std::memory_order_relaxed);
+        if (sent + skipped > 0)
+            DriverLog("%s input updates: sent=%llu skipped=%llu\n", name, (unsigned long long) sent, (unsigned long long) skipped);
+    }
+
+private:
+    bool Count(bool send)
+    {
+        (send ? m_frameSent : m_frameSkipped)++;
+        return send;
+    }
+
+    void Remember(int control, float value)
+    {
+        m_hasLast[control] = true;
+        m_last[control] = value;
+    }
+
+    float m_analogEpsilon;
+    int64_t m_keepAliveNs;
+    int64_t m_lastRefresh;
+    bool m_refresh;
+
+    // last sent value of each control and its touch
+    float m_last[kMaxControls];
+    bool m_hasLast[kMaxControls];
+    bool m_lastTouch[kMaxControls];
+    bool m_hasLastTouch[kMaxControls];
+
+    uint32_t m_frameSent;
+    uint32_t m_frameSkipped;
+    std::atomic<uint64_t> m_sent;
+    std::atomic<uint64_t> m_skipped;
+};
+
+#endif // INPUT_UPDATE_GATE_H
@@ -0,0 +1,170 @@
+#ifndef OHMD_MATH_H
+#define OHMD_MATH_H
+
+#pragma once
+
+#include <openvr_driver.h>
+
+#include <math.h>
+
+// Small vector, quaternion and matrix types for the poses and projections OpenHMD reports.
+// Plain scalar code: compilers vectorize it as well as hand written SSE did, see the math
+// benchmark of driver_benchmark.
+
+struct vec3f
+{
+    float v[3];
+};
+
+// in the order of OHMD_ROTATION_QUAT
+struct quatf
+{
+    float x, y, z, w;
+};
+
+// m[row][col]; arr is the flat view OpenHMD's matrix getters fill
+union mat4x4f
+{
+    float m[4][4];
+    float arr[16];
+};
+
+// index into arr of an element of a row-major or a column-major matrix
+constexpr int mat4x4f_row_major(int row, int col) { return row * 4 + col; }
+constexpr int mat4x4f_column_major(int row, int col) { return col * 4 + row; }
+
+inline vec3f vec3f_load(const float *v)
+{
+    vec3f r = { { v[0], v[1], v[2] } };
+    return r;
+}
+
+inline quatf quatf_load(const float *q)
+{
+    quatf r = { q[0], q[1], q[2], q[3] };
+    return r;
+}
+
+inline void quatf_store(const quatf &q, float *out)
+{
+    out[0] = q.x;
+    out[1] = q.y;
+    out[2] = q.z;
+    out[3] = q.w;
+}
+
+inline quatf quatf_identity()
+{
+    quatf r = { 0, 0, 0, 1 };
+    return r;
+}
+
+inline quatf quatf_conjugate(const quatf &q)
+{
+    quatf r = { -q.x, -q.y, -q.z, q.w };
+    return r;
+}
+
+inline float quatf_dot(const quatf &a, const quatf &b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+}
+
+// a * b, the rotation b followed by a
+inline quatf quatf_mult(const quatf &a, const quatf &b)
+{
+    quatf q;
+    q.x = a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y;
+    q.y = a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x;
+    q.z = a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w;
+    q.w = a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z;
+    return q;
+}
+
+// q scaled to unit length, q itself if it is too short to have a direction
+inline quatf quatf_normalize(const quatf &q)
+{
+    float len = sqrtf(quatf_dot(q, q));
+    if (!(len > 1e-6f))
+        return q;
+    quatf r;
+    r.x = q.x / len;
+    r.y = q.y / len;
+    r.z = q.z / len;
+    r.w = q.w / len;
+    return r;
+}
+
+// spherical linear interpolation between unit quaternions a and b, the short way around
+inline quatf quatf_slerp(const quatf &a, const quatf &b, float t)
+{
+    float dot = quatf_dot(a, b);
+    float sign = dot < 0 ? -1.f : 1.f;
+    dot *= sign;
+
+    float wa, wb;
+    if (dot > 0.9995f) {
+        // nearly parallel, lerp and renormalize below
+        wa = 1.f - t;
+        wb = t;
+    } else {
+        float theta = acosf(dot);
+        float s = 1.f / sinf(theta);
+        wa = sinf((1.f - t) * theta) * s;
+        wb = sinf(t * theta) * s;
+    }
+    wb *= sign;
+
+    quatf q;
+    q.x = wa * a.x + wb * b.x;
+    q.y = wa * a.y + wb * b.y;
+    q.z = wa * a.z + wb * b.z;
+    q.w = wa * a.w + wb * b.w;
+    return quatf_normalize(q);
+}
+
+// unit quaternion rotating by the rotation vector rv (axis * angle in radians)
+inline quatf quatf_from_rotation_vector(const vec3f &rv)
+{
+    float angle = sqrtf(rv.v[0] * rv.v[0] + rv.v[1] * rv.v[1] + rv.v[2] * rv.v[2]);
+    float s = angle < 1e-6f ? 0.5f : sinf(angle / 2) / angle;
+    quatf q = { rv.v[0] * s, rv.v[1] * s, rv.v[2] * s, cosf(angle / 2) };
+    return q;
+}
+
+// rotation vector (axis * angle in radians) of a unit quaternion
+inline vec3f quatf_to_rotation_vector(const quatf &q)
+{
+    float sign = q.w < 0 ? -1.f : 1.f; // take the short way around
+    float len = sqrtf(q.x * q.x + q.y * q.y + q.z * q.z);
+    float scale = len < 1e-6f ? 2.f : 2.f * atan2f(len, sign * q.w) / len;
+    vec3f rv = { { sign * q.x * scale, sign * q.y * scale, sign * q.z * scale } };
+    return rv;
+}
+
+// o = l * r, o may be l or r
+inline void mat4x4f_mult(const mat4x4f &l, const mat4x4f &r, mat4x4f *o)
+{
+    mat4x4f result;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++)
+            result.m[i][j] = l.m[i][0] * r.m[0][j] + l.m[i][1] * r.m[1][j] + l.m[i][2] * r.m[2][j] + l.m[i][3] * r.m[3][j];
+    }
+    *o = result;
+}
+
+inline vr::HmdQuaternion_t quatf_to_hmd(const quatf &q)
+{
+    vr::HmdQuaternion_t r = { q.w, q.x, q.y, q.z };
+    return r;
+}
+
+// into the double vectors of DriverPose_t
+inline void vec3f_to_pose(const vec3f &v, double *out)
+{
+    out[0] = v.v[0];
+    out[1] = v.v[1];
+    out[2] = v.v[2];
+}
+
+#endif // OHMD_MATH_H
@@ -0,0 +1,185 @@
+#ifndef PANEL_ROTATION_H
+#define PANEL_ROTATION_H
+
+#pragma once
+
+#include "distortion.h"
+#include "driverlog.h"
+
+#include <chrono>
+#include <vector>
+#include <math.h>
+
+// How the display panel of an eye is mounted, from the yaw of the OpenHMD projection matrix.
+enum PanelRotation
+{
+    PanelRotation_None,     // landscape
+    PanelRotation_Plus90,   // portrait, rotated by +90 degrees
+    PanelRotation_Minus90,  // portrait, rotated by -90 degrees
+    PanelRotation_Other,    // any other angle, see UVTransform
+};
+
+inline PanelRotation PanelRotationFromAngle(float angle)
+{
+    if (angle > -5 && angle < 5)
+        return PanelRotation_None;
+    if (angle > 85 && angle < 95)
+        return PanelRotation_Plus90;
+    if (angle > -95 && angle < -85)
+        return PanelRotation_Minus90;
+    return PanelRotation_Other;
+}
+
+inline const char *PanelRotationName(PanelRotation rotation)
+{
+    switch (rotation) {
+    case PanelRotation_None: return "none";
+    case PanelRotation_Plus90: return "+90";
+    case PanelRotation_Minus90: return "-90";
+    default: return "other";
+    }
+}
+
+// Affine map of panel UVs to the UVs of the eye viewport the lens model works in,
+// u' = m[0][0] u + m[0][1] v + m[0][2] and v' = m[1][0] u + m[1][1] v + m[1][2].
+struct UVTransform
+{
+    float m[2][3];
+};
+
+// width over height of the eye viewport in meters, 1 if the panel size is unknown
+inline float ViewportAspect(const DistortionBatchParams &p)
+{
+    float aspect = p.viewport_scale[0] / p.viewport_scale[1];
+    return aspect > 0 && aspect < 1e6f ? aspect : 1.0f;
+}
+
+// Rotation about the viewport center that undoes a panel rotated by angle degrees, for a
+// viewport of the given aspect (width over height). The rotation is done in meters and not in
+// UVs, which would shear a viewport that is not square. The rotations PanelRotationFromAngle
+// names use exact zeros and ones: a portrait panel swaps width and height, so its UVs just swap.
+// The rotation part is also what the projection matrix is unrotated with.
+inline UVTransform UnrotationForAngle(float angle, float aspect)
+{
+    float c, s, su, sv; // su = s h / w, sv = s w / h
+    switch (PanelRotationFromAngle(angle)) {
+    case PanelRotation_None: c = 1; su = sv = 0; break;
+    case PanelRotation_Plus90: c = 0; su = sv = 1; break;
+    case PanelRotation_Minus90: c = 0; su = sv = -1; break;
+    default:
+        c = cosf(angle * (float) M_PI / 180);
+        s = sinf(angle * (float) M_PI / 180);
+        su = s / aspect;
+        sv = s * aspect;
+        break;
+    }
+    UVTransform t = { { { c, su, 0.5f - 0.5f * c - 0.5f * su }, { -sv, c, 0.5f + 0.5f * sv - 0.5f * c } } };
+    return t;
+}
+
+// maps a UV of the rotated panel to the eye viewport the lens model works in
+template <PanelRotation R> inline void UnrotateUV(const UVTransform &t, float &fU, float &fV);
+
+template <> inline void UnrotateUV<PanelRotation_None>(const UVTransform &, float &, float &)
+{
+}
+
+template <> inline void UnrotateUV<PanelRotation_Plus90>(const UVTransform &, float &fU, float &fV)
+{
+    float tmp = fV;
+    fV = 1.f - fU;
+    fU = tmp;
+}
+
+template <> inline void UnrotateUV<PanelRotation_Minus90>(const UVTransform &, float &fU, float &fV)
+{
+    float tmp = fV;
+    fV = fU;
+    fU = 1.f - tmp;
+}
+
+template <> inline void UnrotateUV<PanelRotation_Other>(const UVTransform &t, float &fU, float &fV)
+{
+    float x = t.m[0][0] * fU + t.m[0][1] * fV + t.m[0][2];
+    float y = t.m[1][0] * fU + t.m[1][1] * fV + t.m[1][2];
+    fU = x;
+    fV = y;
+}
+
+typedef void (*UnrotateUVBatchFn)(const UVTransform &t, const float *pU, const float *pV, int n, float *u, float *v);
+
+// the rotation is a template parameter so the loop has no branches
+template <PanelRotation R> void UnrotateUVBatch(const UVTransform &t, const float *pU, const float *pV, int n, float *u, float *v)
+{
+    // a local copy, so the compiler knows the stores to u and v don't change it
+    const UVTransform local = t;
+    for (int i = 0; i < n; i++) {
+        u[i] = pU[i];
+        v[i] = pV[i];
+        UnrotateUV<R>(local, u[i], v[i]);
+    }
+}
+
+inline UnrotateUVBatchFn UnrotateUVBatchFor(PanelRotation rotation)
+{
+    switch (rotation) {
+    case PanelRotation_None: return UnrotateUVBatch<PanelRotation_None>;
+    case PanelRotation_Plus90: return UnrotateUVBatch<PanelRotation_Plus90>;
+    case PanelRotation_Minus90: return UnrotateUVBatch<PanelRotation_Minus90>;
+    default: return UnrotateUVBatch<PanelRotation_Other>;
+    }
+}
+
+// everything ComputeDistortion needs to undo the rotation of one panel, resolved once
+struct PanelUnrotation
+{
+    PanelRotation rotation;
+    UVTransform transform;
+    UnrotateUVBatchFn batch;
+
+    void Apply(const float *pU, const float *pV, int n, float *u, float *v) const { batch(transform, pU, pV, n, u, v); }
+};
+
+inline PanelUnrotation PanelUnrotationForAngle(float angle, float aspect)
+{
+    PanelUnrotation unrotation;
+    unrotation.rotation = PanelRotationFromAngle(angle);
+    unrotation.transform = UnrotationForAngle(angle, aspect);
+    unrotation.batch = UnrotateUVBatchFor(unrotation.rotation);
+    return unrotation;
+}
+
+// logs the throughput of the whole distortion path for a landscape, both portrait and a canted
+// panel mounting with the given model
+inline void BenchmarkPanelRotations(const DistortionModel &model)
+{
+    const int side = 256, chunk = 256;
+    const int n = side * side;
+    std::vector<float> pU(n), pV(n);
+    for (int i = 0; i < n; i++) {
+        pU[i] = (i % side) / (float) (side - 1);
+        pV[i] = (i / side) / (float) (side - 1);
+    }
+    std::vector<vr::DistortionCoordinates_t> out(n);
+
+    const float angles[] = { 0, 90, -90, 30 };
+    for (int r = 0; r < 4; r++) {
+        PanelUnrotation unrotation = PanelUnrotationForAngle(angles[r], ViewportAspect(model.GetEyeParams(vr::Eye_Left)));
+        double best = 1e30;
+        for (int run = 0; run < 5; run++) {
+            float u[chunk], v[chunk];
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int i = 0; i < n; i += chunk) {
+                unrotation.Apply(&pU[i], &pV[i], chunk, u, v);
+                model.DistortMany(vr::Eye_Left, u, v, chunk, &out[i]);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (seconds < best)
+                best = seconds;
+        }
+        DriverLog("driver_openhmd: distortion with panel rotation %s (%g degrees): %.1f Msamples/s\n",
+                  PanelRotationName(unrotation.rotation), angles[r], n / best * 1e-6);
+    }
+}
+
+#endif // PANEL_ROTATION_H
@@ -0,0 +1,263 @@
+#ifndef POSE_FILTER_H
+#define POSE_FILTER_H
+
+#pragma once
+
+#include "device_state.h"
+#include "driverlog.h"
+#include "ohmd_math.h"
+
+#include <math.h>
+#include <string.h>
+#include <string>
+#include <sstream>
+
+enum PoseFilterType
+{
+    PoseFilter_None,
+    PoseFilter_Exponential,
+    PoseFilter_OneEuro,
+    PoseFilter_Kalman,
+};
+
+struct PoseFilterParams
+{
+    float exponential_cutoff;   // Hz
+    float oneeuro_min_cutoff;   // Hz
+    float oneeuro_beta;         // cutoff increase per unit/s of speed
+    float oneeuro_d_cutoff;     // Hz, for the speed estimate
+    float kalman_process_noise; // variance of the acceleration, units^2/s^3
+    float kalman_measurement_noise; // variance of a sample, units^2
+};
+
+// A chain of filters shared by all devices of one class (HMD, controllers).
+// Instead of a filter object per device, every stage keeps the state of all devices in flat
+// arrays and Apply runs one stage over the whole batch before moving to the next one, so the
+// filter type is dispatched once per stage and frame, not once per device.
+// Each sample is filtered as 7 channels: the quaternion x, y, z, w and the position x, y, z.
+// The quaternion is flipped to the hemisphere of the previous output before filtering and
+// renormalized afterwards.
+class PoseFilterBank
+{
+public:
+    static const int kMaxDevices = DeviceStateStore::kMaxDevices;
+    static const int kMaxStages = 4;
+    static const int kChannels = 7;
+
+    PoseFilterBank() : m_stageCount(0)
+    {
+        memset(&m_params, 0, sizeof(m_params));
+        memset(m_initialized, 0, sizeof(m_initialized));
+    }
+
+    // chain is a comma separated list of "exponential", "oneeuro" and "kalman", applied in order
+    void Configure(const char *name, const std::string &chain, const PoseFilterParams &params)
+    {
+        m_params = params;
+        m_stageCount = 0;
+
+        std::stringstream ss(chain);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            item.erase(0, item.find_first_not_of(" \t"));
+            item.erase(item.find_last_not_of(" \t") + 1);
+            if (item.empty())
+                continue;
+
+            PoseFilterType type = PoseFilter_None;
+            if (item == "exponential")
+                type = PoseFilter_Exponential;
+            else if (item == "oneeuro")
+                type = PoseFilter_OneEuro;
+            else if (item == "kalman")
+                type = PoseFilter_Kalman;
+
+            if (type == PoseFilter_None) {
+                DriverLog("%s filter: unknown filter \"%s\" ignored\n", name, item.c_str());
+            } else if (m_stageCount == kMaxStages) {
+                DriverLog("%s filter: more than %d filters, \"%s\" ignored\n", name, kMaxStages, item.c_str());
+            } else {
+                DriverLog("%s filter: stage %d %s\n", name, m_stageCount, item.c_str());
+                m_stages[m_stageCount++] = type;
+            }
+        }
+        memset(m_initialized, 0, sizeof(m_initialized));
+    }
+
+    bool Empty() const { return m_stageCount == 0; }
+
+    // Filters the ingested poses of the given store slots in place. Row i of the bank state
+    // belongs to slots[i], so the same slots have to be passed in the same order every time.
+    void Apply(DeviceStateStore &store, const int *slots, int count)
+    {
+        if (m_stageCount == 0)
+            return;
+        if (count > kMaxDevices)
+            count = kMaxDevices;
+
+        float x[kMaxDevices][kChannels];
+        float dt[kMaxDevices];
+
+        for (int row = 0; row < count; row++) {
+            int slot = slots[row];
+            x[row][0] = store.qx[slot];
+            x[row][1] = store.qy[slot];
+            x[row][2] = store.qz[slot];
+            x[row][3] = store.qw[slot];
+            x[row][4] = store.px[slot];
+            x[row][5] = store.py[slot];
+            x[row][6] = store.pz[slot];
+
+            if (m_initialized[row]) {
+                const float *prev = m_output[row];
+                if (x[row][0] * prev[0] + x[row][1] * prev[1] + x[row][2] * prev[2] + x[row][3] * prev[3] < 0) {
+                    for (int c = 0; c < 4; c++)
+                        x[row][c] = -x[row][c];
+                }
+                dt[row] = (store.time[slot] - m_lastTime[row]) * 1e-9f;
+            } else {
+                dt[row] = 0;
+            }
+            m_lastTime[row] = store.time[slot];
+        }
+
+        for (int stage = 0; stage < m_stageCount; stage++) {
+            switch (m_stages[stage]) {
+            case PoseFilter_Exponential:
+                ApplyExponential(stage, count, x, dt);
+                break;
+            case PoseFilter_OneEuro:
+                ApplyOneEuro(stage, count, x, dt);
+                break;
+            case PoseFilter_Kalman:
+                ApplyKalman(stage, count, x, dt);
+                break;
+            default:
+                break;
+            }
+        }
+
+        for (int row = 0; row < count; row++) {
+            quatf_store(quatf_normalize(quatf_load(x[row])), x[row]);
+
+            memcpy(m_output[row], x[row], sizeof(x[row]));
+            m_initialized[row] = true;
+
+            int slot = slots[row];
+            store.qx[slot] = x[row][0];
+            store.qy[slot] = x[row][1];
+            store.qz[slot] = x[row][2];
+            store.qw[slot] = x[row][3];
+            store.px[slot] = x[row][4];
+            store.py[slot] = x[row][5];
+            store.pz[slot] = x[row][6];
+        }
+    }
+
+private:
+    // smoothing factor of a first order low pass for the given sample interval
+    static float LowPassAlpha(float cutoff, float dt)
+    {
+        float tau = 1.f / (2.f * 3.14159265f * cutoff);
+        return 1.f / (1.f + tau / dt);
+    }
+
+    void ApplyExponential(int stage, int count, float (*x)[kChannels], const float *dt)
+    {
+        float (*y)[kChannels] = m_state[stage].value;
+        for (int row = 0; row < count; row++) {
+            if (dt[row] <= 0) {
+                memcpy(y[row], x[row], sizeof(y[row]));
+                continue;
+            }
+            float alpha = LowPassAlpha(m_params.exponential_cutoff, dt[row]);
+            for (int c = 0; c < kChannels; c++) {
+                y[row][c] += alpha * (x[row][c] - y[row][c]);
+                x[row][c] = y[row][c];
+            }
+        }
+    }
+
+    // http://cristal.univ-lille.fr/~casiez/1euro/
+    void ApplyOneEuro(int stage, int count, float (*x)[kChannels], const float *dt)
+    {
+        float (*y)[kChannels] = m_state[stage].value;
+        float (*dy)[kChannels] = m_state[stage].rate;
+        for (int row = 0; row < count; row++) {
+            if (dt[row] <= 0) {
+                memcpy(y[row], x[row], sizeof(y[row]));
+                memset(dy[row], 0, sizeof(dy[row]));
+                continue;
+            }
+            float d_alpha = LowPassAlpha(m_params.oneeuro_d_cutoff, dt[row]);
+            for (int c = 0; c < kChannels; c++) {
+                float rate = (x[row][c] - y[row][c]) / dt[row];
+                dy[row][c] += d_alpha * (rate - dy[row][c]);
+                float cutoff = m_params.oneeuro_min_cutoff + m_params.oneeuro_beta * fabsf(dy[row][c]);
+                y[row][c] += LowPassAlpha(cutoff, dt[row]) * (x[row][c] - y[row][c]);
+                x[row][c] = y[row][c];
+            }
+        }
+    }
+
+    // constant velocity model per channel, state is value and rate with a 2x2 covariance
+    void ApplyKalman(int stage, int count, float (*x)[kChannels], const float *dt)
+    {
+        State &st = m_state[stage];
+        const float q = m_params.kalman_process_noise;
+        const float r = m_params.kalman_measurement_noise;
+        for (int row = 0; row < count; row++) {
+            if (dt[row] <= 0) {
+                memcpy(st.value[row], x[row], sizeof(st.value[row]));
+                memset(st.rate[row], 0, sizeof(st.rate[row]));
+                for (int c = 0; c < kChannels; c++) {
+                    st.p00[row][c] = r;
+                    st.p01[row][c] = 0;
+                    st.p11[row][c] = r;
+                }
+                continue;
+            }
+            float t = dt[row];
+            float t2 = t * t, t3 = t2 * t;
+            for (int c = 0; c < kChannels; c++) {
+                // predict
+                float v = st.value[row][c] + t * st.rate[row][c];
+                float p00 = st.p00[row][c] + t * (2 * st.p01[row][c] + t * st.p11[row][c]) + q * t3 / 3;
+                float p01 = st.p01[row][c] + t * st.p11[row][c] + q * t2 / 2;
+                float p11 = st.p11[row][c] + q * t;
+
+                // update
+                float k0 = p00 / (p00 + r);
+                float k1 = p01 / (p00 + r);
+                float innovation = x[row][c] - v;
+                st.value[row][c] = v + k0 * innovation;
+                st.rate[row][c] += k1 * innovation;
+                st.p00[row][c] = (1 - k0) * p00;
+                st.p01[row][c] = (1 - k0) * p01;
+                st.p11[row][c] = p11 - k1 * p01;
+
+                x[row][c] = st.value[row][c];
+            }
+        }
+    }
+
+    struct State
+    {
+        float value[kMaxDevices][kChannels];
+        float rate[kMaxDevices][kChannels];
+        float p00[kMaxDevices][kChannels];
+        float p01[kMaxDevices][kChannels];
+        float p11[kMaxDevices][kChannels];
+    };
+
+    PoseFilterType m_stages[kMaxStages];
+    State m_state[kMaxStages];
+    int m_stageCount;
+    PoseFilterParams m_params;
+
+    bool m_initialized[kMaxDevices];
+    int64_t m_lastTime[kMaxDevices];
+    float m_output[kMaxDevices][kChannels];
+};
+
+#endif // POSE_FILTER_H
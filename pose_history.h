@@ -0,0 +1,149 @@
+#ifndef POSE_HISTORY_H
+#define POSE_HISTORY_H
+
+#pragma once
+
+#include "pose_snapshot.h"
+#include "ohmd_math.h"
+
+#include <math.h>
+
+// Ring buffer of the most recent samples of one device, ordered by time.
+// Written and read only by the pose producer (the tracking thread, or RunFrame without it).
+// It never allocates; at 1 kHz it holds the last second of samples, with RunFrame updates
+// at 90 Hz the last 11 seconds.
+class PoseHistory
+{
+public:
+    static const int kCapacity = 1024; // power of two
+    static const int64_t kMaxExtrapolationNs = 50000000;
+
+    PoseHistory() : m_head(0), m_count(0) {}
+
+    void Push(const PoseSample &sample)
+    {
+        m_head = (m_head + 1) & (kCapacity - 1);
+        m_samples[m_head] = sample;
+        if (m_count < kCapacity)
+            m_count++;
+    }
+
+    int Count() const { return m_count; }
+
+    // age 0 is the newest sample
+    const PoseSample &Get(int age) const { return m_samples[(m_head - age) & (kCapacity - 1)]; }
+
+    // Least squares slope of position and rotation over the samples of the last window_ns
+    // (at least two samples), which is a finite difference that averages out sensor noise.
+    // Rotations are taken relative to the oldest sample in the window, in world space.
+    // The result is stored in vel and angvel of the newest sample.
+    void EstimateVelocity(int64_t window_ns)
+    {
+        PoseSample &newest = m_samples[m_head];
+        float *vel = newest.vel;
+        float *angvel = newest.angvel;
+        for (int i = 0; i < 3; i++)
+            vel[i] = angvel[i] = 0;
+
+        int n = 1;
+        while (n < m_count && (n < 2 || newest.time - Get(n).time <= window_ns))
+            n++;
+        if (n < 2)
+            return;
+
+        const PoseSample &oldest = Get(n - 1);
+        quatf oldest_inv = quatf_conjugate(quatf_load(oldest.quat));
+
+        double st = 0, stt = 0;
+        double sp[3] = { 0 }, stp[3] = { 0 }, sr[3] = { 0 }, str[3] = { 0 };
+        for (int age = 0; age < n; age++) {
+            const PoseSample &s = Get(age);
+            double t = (s.time - oldest.time) * 1e-9;
+
+            vec3f rv = quatf_to_rotation_vector(quatf_mult(quatf_load(s.quat), oldest_inv));
+
+            st += t;
+            stt += t * t;
+            for (int i = 0; i < 3; i++) {
+                sp[i] += s.pos[i];
+                stp[i] += t * s.pos[i];
+                sr[i] += rv.v[i];
+                str[i] += t * rv.v[i];
+            }
+        }
+
+        double denom = n * stt - st * st;
+        if (denom <= 0)
+            return;
+        for (int i = 0; i < 3; i++) {
+            vel[i] = (n * stp[i] - st * sp[i]) / denom;
+            angvel[i] = (n * str[i] - st * sr[i]) / denom;
+        }
+    }
+
+    // Pose at the given PoseClockNow() time. Between two samples rotation is slerped and
+    // position follows a cubic Hermite curve through both samples and their velocities.
+    // Past the newest sample the pose is extrapolated with its velocities, by at most
+    // kMaxExtrapolationNs. Before the oldest sample the oldest sample is returned.
+    PoseSample PoseAt(int64_t time) const
+    {
+        PoseSample result = PoseSample();
+        if (m_count == 0)
+            return result;
+
+        result = Get(0);
+        if (time >= result.time) {
+            int64_t dt_ns = time - result.time;
+            if (dt_ns > kMaxExtrapolationNs)
+                dt_ns = kMaxExtrapolationNs;
+            float dt = dt_ns * 1e-9f;
+
+            vec3f rv;
+            for (int i = 0; i < 3; i++) {
+                result.pos[i] += result.vel[i] * dt;
+                rv.v[i] = result.angvel[i] * dt;
+            }
+            quatf_store(quatf_mult(quatf_from_rotation_vector(rv), quatf_load(Get(0).quat)), result.quat);
+            result.time = time;
+            return result;
+        }
+
+        // binary search for the newest sample at or before time
+        int lo = 1, hi = m_count - 1;
+        if (Get(hi).time > time)
+            return Get(hi);
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (Get(mid).time <= time)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+
+        const PoseSample &a = Get(lo);
+        const PoseSample &b = Get(lo - 1);
+        float h = (b.time - a.time) * 1e-9f;
+        float t = h > 0 ? (time - a.time) * 1e-9f / h : 1.f;
+
+        float t2 = t * t, t3 = t2 * t;
+        float h00 = 2 * t3 - 3 * t2 + 1;
+        float h10 = t3 - 2 * t2 + t;
+        float h01 = -2 * t3 + 3 * t2;
+        float h11 = t3 - t2;
+        for (int i = 0; i < 3; i++) {
+            result.pos[i] = h00 * a.pos[i] + h10 * h * a.vel[i] + h01 * b.pos[i] + h11 * h * b.vel[i];
+            result.vel[i] = a.vel[i] + (b.vel[i] - a.vel[i]) * t;
+            result.angvel[i] = a.angvel[i] + (b.angvel[i] - a.angvel[i]) * t;
+        }
+        quatf_store(quatf_slerp(quatf_load(a.quat), quatf_load(b.quat), t), result.quat);
+        result.time = time;
+        return result;
+    }
+
+private:
+    PoseSample m_samples[kCapacity];
+    int m_head;
+    int m_count;
+};
+
+#endif // POSE_HISTORY_H
@@ -0,0 +1,96 @@
+#ifndef POSE_SNAPSHOT_H
+#define POSE_SNAPSHOT_H
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+#include <stdint.h>
+#include <string.h>
+
+// Sequence lock for a single writer and any number of readers.
+// The writer never waits and readers never take a lock; a read that overlaps a write retries,
+// so a reader always gets a complete value and never a torn mix of two writes.
+// The payload is kept in relaxed atomic words so concurrent access is well defined; on x86 and
+// ARM these compile to plain loads and stores.
+template <typename T>
+class SeqLock
+{
+public:
+    SeqLock() : m_seq(0)
+    {
+        for (size_t i = 0; i < kWords; i++)
+            m_words[i].store(0, std::memory_order_relaxed);
+    }
+
+    // only one thread may call Store
+    void Store(const T &value)
+    {
+        uint32_t buf[kWords] = { 0 };
+        memcpy(buf, &value, sizeof(T));
+
+        uint32_t seq = m_seq.load(std::memory_order_relaxed);
+        m_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < kWords; i++)
+            m_words[i].store(buf[i], std::memory_order_relaxed);
+        m_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    T Load() const
+    {
+        uint32_t buf[kWords];
+        uint32_t before, after;
+        do {
+            before = m_seq.load(std::memory_order_acquire);
+            for (size_t i = 0; i < kWords; i++)
+                buf[i] = m_words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = m_seq.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        T value;
+        memcpy(&value, buf, sizeof(T));
+        return value;
+    }
+
+private:
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock payload must be trivially copyable");
+    static const size_t kWords = (sizeof(T) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+
+    std::atomic<uint32_t> m_seq;
+    std::atomic<uint32_t> m_words[kWords];
+};
+
+// Timestamps of pose samples, in nanoseconds of std::chrono::steady_clock
+inline int64_t PoseClockNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// One tracking sample of a device, as read from OpenHMD after ohmd_ctx_update.
+struct PoseSample
+{
+    float quat[4];   // x, y, z, w like OHMD_ROTATION_QUAT
+    float pos[3];    // meters, like OHMD_POSITION_VECTOR
+    float vel[3];    // meters/second
+    float angvel[3]; // axis-angle, radians/second
+    int64_t time;    // PoseClockNow() when the sample was read
+};
+
+typedef SeqLock<PoseSample> PoseSnapshot;
+
+// Controls of a controller, as read from OpenHMD after ohmd_ctx_update.
+struct ControlSample
+{
+    static const int kMaxControls = 64;
+
+    float state[kMaxControls];     // like OHMD_CONTROLS_STATE
+    int64_t changed[kMaxControls]; // PoseClockNow() of the first read with the current value
+    int64_t time;                  // PoseClockNow() when the controls were read, 0 before the first read
+};
+
+typedef SeqLock<ControlSample> ControlSnapshot;
+
+#endif // POSE_SNAPSHOT_H
@@ -0,0 +1,90 @@
+#ifndef POSE_UPDATE_GATE_H
+#define POSE_UPDATE_GATE_H
+
+#pragma once
+
+#include <openvr_driver.h>
+#include "driverlog.h"
+
+#include <math.h>
+#include <stdint.h>
+
+// Decides whether a pose is worth sending to vrserver with TrackedDevicePoseUpdated.
+// A pose is sent when the rotation or position moved by more than an epsilon since the last
+// sent pose, when the velocities changed enough that SteamVR's extrapolation of the last sent
+// pose would be off by more than an epsilon before the next keep-alive, when the tracking state
+// changed, or when the last send is older than the keep-alive interval.
+// Only used by the pose producer.
+class PoseUpdateGate
+{
+public:
+    PoseUpdateGate() : m_angleEpsilon(0), m_positionEpsilon(0), m_keepAliveNs(0), m_hasLast(false), m_lastSent(0), m_sent(0), m_suppressed(0) {}
+
+    // angle in radians, position in meters, a keep_alive_ns of 0 sends every pose
+    void Configure(float angle_epsilon, float position_epsilon, int64_t keep_alive_ns)
+    {
+        m_angleEpsilon = angle_epsilon;
+        m_positionEpsilon = position_epsilon;
+        m_keepAliveNs = keep_alive_ns;
+        m_hasLast = false;
+    }
+
+    bool ShouldSend(const vr::DriverPose_t &pose, int64_t now)
+    {
+        if (m_hasLast && now - m_lastSent < m_keepAliveNs && !Changed(pose)) {
+            m_suppressed++;
+            return false;
+        }
+
+        m_last = pose;
+        m_hasLast = true;
+        m_lastSent = now;
+        m_sent++;
+        return true;
+    }
+
+    // logs the counters since the last report and starts over
+    void Report(const char *name)
+    {
+        if (m_sent + m_suppressed > 0)
+            DriverLog("%s pose updates: sent=%llu suppressed=%llu\n", name, (unsigned long long) m_sent, (unsigned long long) m_suppressed);
+        m_sent = 0;
+        m_suppressed = 0;
+    }
+
+private:
+    bool Changed(const vr::DriverPose_t &pose) const
+    {
+        if (pose.poseIsValid != m_last.poseIsValid || pose.result != m_last.result || pose.deviceIsConnected != m_last.deviceIsConnected)
+            return true;
+
+        // angle between the rotations is 2 * acos(|dot|), compared without the acos
+        const vr::HmdQuaternion_t &a = pose.qRotation, &b = m_last.qRotation;
+        double dot = fabs(a.w * b.w + a.x * b.x + a.y * b.y + a.z * b.z);
+        if (dot < cos(m_angleEpsilon / 2))
+            return true;
+
+        // drift of SteamVR's extrapolation of the last sent pose until the next keep-alive
+        double horizon = m_keepAliveNs * 1e-9;
+        double dp = 0, dv = 0, dw = 0;
+        for (int i = 0; i < 3; i++) {
+            dp += (pose.vecPosition[i] - m_last.vecPosition[i]) * (pose.vecPosition[i] - m_last.vecPosition[i]);
+            dv += (pose.vecVelocity[i] - m_last.vecVelocity[i]) * (pose.vecVelocity[i] - m_last.vecVelocity[i]);
+            dw += (pose.vecAngularVelocity[i] - m_last.vecAngularVelocity[i]) * (pose.vecAngularVelocity[i] - m_last.vecAngularVelocity[i]);
+        }
+        return sqrt(dp) > m_positionEpsilon || sqrt(dv) * horizon > m_positionEpsilon || sqrt(dw) * horizon > m_angleEpsilon;
+    }
+
+    float m_angleEpsilon;
+    float m_positionEpsilon;
+    int64_t m_keepAliveNs;
+
+    bool m_hasLast;
+    vr::DriverPose_t m_last;
+    int64_t m_lastSent;
+
+    uint64_t m_sent;
+    uint64_t m_suppressed;
+};
+
+#endif // POSE_UPDATE_GATE_H
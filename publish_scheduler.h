@@ -0,0 +1,146 @@
+#ifndef PUBLISH_SCHEDULER_H
+#define PUBLISH_SCHEDULER_H
+
+#pragma once
+
+#include "device_state.h"
+
+#include <stdint.h>
+
+// Implemented by the device drivers, called when the device is due to send its pose to SteamVR.
+class PosePublisher
+{
+public:
+    virtual ~PosePublisher() {}
+    // time is the PoseClockNow() time the pose is due at
+    virtual void UpdatePose(int64_t time) = 0;
+    // PoseClockNow() time of the newest pose sample, 0 if there is none yet
+    virtual int64_t NewestSampleTime() = 0;
+};
+
+// Timing wheel deciding which devices publish their pose in an update of the pose producer.
+// Every device has its own publish period. The wheel has one bucket per tick of the pose
+// producer, entries are linked into the bucket of their due tick and Run only visits the
+// buckets of the ticks that passed, so the cost of an update is proportional to the number of
+// devices that are due, not to the number of devices. Entries that are due more than one
+// wheel revolution ahead simply stay in their bucket for another round.
+// Entries with the same period are spread over different ticks to even out the cost per update.
+// Entries with a period of 0 are not in the wheel, they publish in every update, also in two
+// updates within one tick.
+// Used only by the pose producer; all entries are added before it starts.
+class PublishScheduler
+{
+public:
+    static const int kMaxEntries = DeviceStateStore::kMaxDevices;
+    static const int kWheelSize = 256; // power of two
+
+    PublishScheduler() : m_count(0), m_tickNs(1000000), m_lastTick(0)
+    {
+        for (int i = 0; i < kWheelSize; i++)
+            m_bucket[i] = -1;
+    }
+
+    // tick_ns is the interval of the pose producer, a period of 0 publishes in every update
+    void Start(int64_t tick_ns, int64_t now)
+    {
+        m_tickNs = tick_ns > 0 ? tick_ns : 1;
+        m_lastTick = now / m_tickNs;
+        for (int i = 0; i < kWheelSize; i++)
+            m_bucket[i] = -1;
+        for (int i = 0; i < m_count; i++) {
+            if (m_period[i] == 0)
+                continue;
+            int64_t stagger = m_period[i] > m_tickNs ? (i * m_tickNs) % m_period[i] : 0;
+            Insert(i, now + stagger);
+        }
+    }
+
+    // returns false if there are too many entries
+    bool Add(PosePublisher *publisher, int64_t period_ns)
+    {
+        if (m_count == kMaxEntries)
+            return false;
+        m_publisher[m_count] = publisher;
+        m_period[m_count] = period_ns > 0 ? period_ns : 0;
+        m_count++;
+        return true;
+    }
+
+    // calls UpdatePose of every publisher that is due at now, with the time it was due at, so
+    // periodic publishers sample their pose on an even grid
+    void Run(int64_t now)
+    {
+        // the sample this update just ingested
+        for (int i = 0; i < m_count; i++) {
+            if (m_period[i] == 0)
+                m_publisher[i]->UpdatePose(now);
+        }
+
+        int64_t tick = now / m_tickNs;
+        int64_t first = m_lastTick + 1;
+        // after a long stall every bucket is visited once
+        if (tick - first >= kWheelSize)
+            first = tick - kWheelSize + 1;
+
+        int due[kMaxEntries];
+        int dueCount = 0;
+        for (int64_t t = first; t <= tick; t++) {
+            int *link = &m_bucket[t & (kWheelSize - 1)];
+            while (*link >= 0) {
+                int entry = *link;
+                if (m_due[entry] / m_tickNs <= tick) {
+                    *link = m_next[entry];
+                    due[dueCount++] = entry;
+                } else {
+                    link = &m_next[entry];
+                }
+            }
+        }
+        m_lastTick = tick;
+
+        for (int i = 0; i < dueCount; i++) {
+            int entry = due[i];
+            // a publish that is late by more than a tick, after a stall or between two sparse
+            // RunFrame calls, samples the pose at now instead of in the past, and never before
+            // the newest sample, which is already ingested
+            int64_t at = m_due[entry];
+            if (at < now - m_tickNs || at > now)
+                at = now;
+            int64_t newest = m_publisher[entry]->NewestSampleTime();
+            if (newest > at && newest <= now)
+                at = newest;
+            m_publisher[entry]->UpdatePose(at);
+
+            // after a stall continue from now instead of publishing a burst
+            int64_t next = m_due[entry] + m_period[entry];
+            if (next <= now)
+                next = now + m_period[entry];
+            Insert(entry, next);
+        }
+    }
+
+private:
+    void Insert(int entry, int64_t due)
+    {
+        // never into a bucket Run already visited
+        int64_t tick = due / m_tickNs;
+        if (tick <= m_lastTick)
+            tick = m_lastTick + 1;
+        m_due[entry] = due;
+        int bucket = (int) (tick & (kWheelSize - 1));
+        m_next[entry] = m_bucket[bucket];
+        m_bucket[bucket] = entry;
+    }
+
+    PosePublisher *m_publisher[kMaxEntries];
+    int64_t m_period[kMaxEntries];
+    int64_t m_due[kMaxEntries];
+    int m_next[kMaxEntries];
+    int m_count;
+
+    int m_bucket[kWheelSize];
+    int64_t m_tickNs;
+    int64_t m_lastTick;
+};
+
+#endif // PUBLISH_SCHEDULER_H
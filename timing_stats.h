@@ -0,0 +1,109 @@
+#ifndef TIMING_STATS_H
+#define TIMING_STATS_H
+
+#pragma once
+
+#include "driverlog.h"
+
+#include <string>
+#include <stdint.h>
+#include <string.h>
+
+// Histogram of durations in nanoseconds with 8 logarithmic buckets per power of two,
+// so percentiles are accurate to about 10%. Not thread safe, every histogram has one owner.
+class TimingHistogram
+{
+public:
+    explicit TimingHistogram(const std::string &name) : m_name(name) { Reset(); }
+
+    void Add(int64_t ns)
+    {
+        uint64_t v = ns > 0 ? (uint64_t) ns : 0;
+        m_buckets[Bucket(v)]++;
+        m_count++;
+        m_sum += v;
+        if (v > m_max)
+            m_max = v;
+    }
+
+    uint64_t Count() const { return m_count; }
+
+    // value below which the given fraction of samples fall, in nanoseconds
+    uint64_t Percentile(double fraction) const
+    {
+        uint64_t target = (uint64_t) (fraction * m_count);
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; i++) {
+            seen += m_buckets[i];
+            if (seen > target)
+                return BucketLimit(i) < m_max ? BucketLimit(i) : m_max;
+        }
+        return m_max;
+    }
+
+    // logs the distribution since the last report and starts over
+    void Report()
+    {
+        if (m_count > 0) {
+            DriverLog("%s: n=%llu mean=%.3fms p50=%.3fms p90=%.3fms p99=%.3fms max=%.3fms\n", m_name.c_str(),
+                      (unsigned long long) m_count, m_sum / (double) m_count * 1e-6,
+                      Percentile(0.5) * 1e-6, Percentile(0.9) * 1e-6, Percentile(0.99) * 1e-6, m_max * 1e-6);
+        }
+        Reset();
+    }
+
+    void Reset()
+    {
+        memset(m_buckets, 0, sizeof(m_buckets));
+        m_count = 0;
+        m_sum = 0;
+        m_max = 0;
+    }
+
+private:
+    static const int kSubBits = 3;
+    static const int kBuckets = 64 << kSubBits;
+
+    static int Bucket(uint64_t v)
+    {
+        if (v < (1u << kSubBits))
+            return (int) v;
+        int exp = 63 - CountLeadingZeros(v);
+        int sub = (int) (v >> (exp - kSubBits)) & ((1 << kSubBits) - 1);
+        return ((exp - kSubBits + 1) << kSubBits) + sub;
+    }
+
+    // upper bound of the values in bucket i
+    static uint64_t BucketLimit(int i)
+    {
+        if (i < (1 << kSubBits))
+            return (uint64_t) i;
+        int exp = (i >> kSubBits) + kSubBits - 1;
+        uint64_t sub = (uint64_t) (i & ((1 << kSubBits) - 1));
+        if (exp >= 63)
+            return UINT64_MAX;
+        return (((1ull << kSubBits) + sub + 1) << (exp - kSubBits)) - 1;
+    }
+
+    static int CountLeadingZeros(uint64_t v)
+    {
+#if defined(__GNUC__)
+        return __builtin_clzll(v);
+#else
+        int n = 0;
+        while (!(v & (1ull << 63))) {
+            v <<= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    std::string m_name;
+    uint32_t m_buckets[kBuckets];
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_max;
+};
+
+#endif // TIMING_STATS_H